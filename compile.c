@@ -1,29 +1,76 @@
 #include "lisp.h"
+#include "vm.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* A block that the bytecode compiler turns into a jump, see
+   emit_local_block() */
+struct local_block {
+    lisp_object_t name;
+    int depth;
+    int contexts;
+    int scopes;
+    lisp_object_t exits; /* offsets of the jumps to the end */
+    struct local_block *next;
+};
+
+/* A tagbody whose go forms the bytecode compiler turns into jumps, see
+   emit_tagbody() */
+struct local_tagbody {
+    lisp_object_t tags; /* (tag offset . jumps); the offset is nil until the tag is reached */
+    int depth;
+    int contexts;
+    int scopes;
+    struct local_tagbody *next;
+};
 
 struct lexical_context {
+    /* Maps the name of a block to its number, or to t for a local block */
     lisp_object_t block_alist;
     lisp_object_t next_block_number;
+    /* The variables of each frame, innermost first; only the bytecode
+       compiler uses this */
+    lisp_object_t scopes;
+    /* For each of scopes, those of its variables known to hold
+       integers */
+    lisp_object_t fixnum_scopes;
+    struct local_block *local_blocks;
+    struct local_tagbody *local_tagbodies;
+    /* The numbers of the blocks that compile() has seen a return-from
+       for */
+    lisp_object_t returned_blocks;
 };
 
+/* The Lisp objects of a lexical context on the stack are registered
+   with the collector for as long as it is in scope */
+#define GC_PROTECT_LEXICAL_CONTEXT(ctxt) \
+    GC_PROTECT((ctxt).block_alist);       \
+    GC_PROTECT((ctxt).scopes);            \
+    GC_PROTECT((ctxt).fixnum_scopes);     \
+    GC_PROTECT((ctxt).returned_blocks)
+
 static void lexical_context_init(struct lexical_context *ctxt)
 {
     ctxt->block_alist = NIL;
     ctxt->next_block_number = 0;
+    ctxt->scopes = NIL;
+    ctxt->fixnum_scopes = NIL;
+    ctxt->local_blocks = NULL;
+    ctxt->local_tagbodies = NULL;
+    ctxt->returned_blocks = NIL;
 }
 
 static lisp_object_t lexical_context_enter_block(struct lexical_context *ctxt, lisp_object_t block_name)
 {
-    struct symbol *s = SymbolPtr(interp->syms.pctblock);
-    lisp_object_t block_number = NIL;
-    if (s->value == NIL)
-        s->value = 0;
-    block_number = s->value;
-    ctxt->block_alist = cons(cons(block_name, block_number), ctxt->block_alist);
-    s->value += 16;
+    lisp_object_t block_number = SymbolPtr(interp->syms.pctblock)->value;
+    if (block_number == NIL)
+        block_number = 0;
+    set_symbol_value(interp->syms.pctblock, block_number + 16);
+    lisp_object_t entry = cons(block_name, block_number);
+    ctxt->block_alist = cons(entry, ctxt->block_alist);
     return block_number;
 }
 
@@ -35,153 +82,863 @@ static void lexical_context_leave_block(struct lexical_context *ctxt, lisp_objec
     ctxt->block_alist = cdr(ctxt->block_alist);
 }
 
+static void lexical_context_enter_scope(struct lexical_context *ctxt, lisp_object_t vars, lisp_object_t fixnums)
+{
+    GC_PROTECT(fixnums);
+    ctxt->scopes = cons(vars, ctxt->scopes);
+    ctxt->fixnum_scopes = cons(fixnums, ctxt->fixnum_scopes);
+}
+
+static void lexical_context_leave_scope(struct lexical_context *ctxt)
+{
+    assert(ctxt->scopes != NIL);
+    ctxt->scopes = cdr(ctxt->scopes);
+    ctxt->fixnum_scopes = cdr(ctxt->fixnum_scopes);
+}
+
+static int memberp(lisp_object_t x, lisp_object_t list)
+{
+    for (; consp(list) != NIL; list = cdr(list))
+        if (car(list) == x)
+            return 1;
+    return 0;
+}
+
+static int lexical_context_fixnum_p(struct lexical_context *ctxt, lisp_object_t var)
+{
+    lisp_object_t fixnums = ctxt->fixnum_scopes;
+    for (lisp_object_t scope = ctxt->scopes; scope != NIL; scope = cdr(scope), fixnums = cdr(fixnums))
+        if (memberp(var, car(scope)))
+            return memberp(var, car(fixnums));
+    return 0;
+}
+
+static int lexical_context_scope_count(struct lexical_context *ctxt)
+{
+    int count = 0;
+    for (lisp_object_t scope = ctxt->scopes; scope != NIL; scope = cdr(scope))
+        count++;
+    return count;
+}
+
+/* Finds the frame and slot a variable is bound in, or returns 0 if it
+   is free */
+static int lexical_context_lookup(struct lexical_context *ctxt, lisp_object_t var, int *depth, int *slot)
+{
+    *depth = 0;
+    for (lisp_object_t scope = ctxt->scopes; scope != NIL; scope = cdr(scope), (*depth)++) {
+        *slot = FRAME_FIRST_SLOT;
+        for (lisp_object_t x = car(scope); x != NIL; x = cdr(x), (*slot)++)
+            if (car(x) == var)
+                return 1;
+    }
+    return 0;
+}
+
+#define RETURN_FROM_BODY 1
+#define RETURN_FROM_CLOSURE 2
+
+/* Looks for return-from forms naming the block anywhere in e, which
+   may over-count (e.g. in quoted data or under an inner block of the
+   same name) but never misses one */
+static int find_return_from(lisp_object_t e, lisp_object_t block_name, int in_closure)
+{
+    if (atom(e) != NIL || car(e) == interp->syms.quote)
+        return 0;
+    if (car(e) == interp->syms.return_from && consp(cdr(e)) != NIL && cadr(e) == block_name)
+        return (in_closure ? RETURN_FROM_CLOSURE : RETURN_FROM_BODY) | find_return_from(cddr(e), block_name, in_closure);
+    if (car(e) == interp->syms.function && consp(cdr(e)) != NIL && consp(cadr(e)) != NIL)
+        return find_return_from(cadr(e), block_name, 1);
+    int found = 0;
+    for (; consp(e) != NIL; e = cdr(e))
+        found |= find_return_from(car(e), block_name, in_closure);
+    return found;
+}
+
+/* Looks for go forms naming one of the tags inside a closure in e,
+   which may over-count in the same ways as find_return_from() */
+static int find_go_in_closure(lisp_object_t e, lisp_object_t tags, int in_closure)
+{
+    if (atom(e) != NIL || car(e) == interp->syms.quote)
+        return 0;
+    if (car(e) == interp->syms.go && consp(cdr(e)) != NIL && assoc(cadr(e), tags) != NIL)
+        return in_closure;
+    if (car(e) == interp->syms.function && consp(cdr(e)) != NIL && consp(cadr(e)) != NIL)
+        return find_go_in_closure(cadr(e), tags, 1);
+    for (; consp(e) != NIL; e = cdr(e))
+        if (find_go_in_closure(car(e), tags, in_closure))
+            return 1;
+    return 0;
+}
+
 static lisp_object_t compile(lisp_object_t, struct lexical_context *ctxt);
 
+/* Like the rest of the compile pass, this only allocates where the
+   result differs from its input */
 static lisp_object_t compile_list(lisp_object_t list, struct lexical_context *ctxt)
 {
-    if (list == NIL)
-        return NIL;
-    else
-        return cons(compile(car(list), ctxt), compile_list(cdr(list), ctxt));
+    if (consp(list) == NIL)
+        return list;
+    GC_PROTECT(list);
+    lisp_object_t first = compile(car(list), ctxt);
+    GC_PROTECT(first);
+    lisp_object_t rest = compile_list(cdr(list), ctxt);
+    return cons_if_changed(list, first, rest);
 }
 
 static lisp_object_t compile_let_varlist(lisp_object_t expr, struct lexical_context *ctxt)
 {
-    if (expr == NIL) {
+    if (expr == NIL)
         return NIL;
-    } else {
-        lisp_object_t first = car(expr);
-        if (consp(first) != NIL)
-            return cons(List(car(first), compile(cadr(first), ctxt)), compile_let_varlist(cdr(expr), ctxt));
-        else
-            return cons(first, compile_let_varlist(cdr(expr), ctxt));
+    GC_PROTECT(expr);
+    lisp_object_t rest = compile_let_varlist(cdr(expr), ctxt);
+    GC_PROTECT(rest);
+    lisp_object_t first = car(expr);
+    GC_PROTECT(first);
+    if (consp(first) != NIL) {
+        lisp_object_t forms = compile_list(cdr(first), ctxt);
+        first = cons_if_changed(first, car(first), forms);
     }
+    return cons_if_changed(expr, first, rest);
 }
 
 static lisp_object_t compile_let(lisp_object_t expr, struct lexical_context *ctxt)
 {
-    lisp_object_t varlist = cadr(expr);
-    lisp_object_t body = cddr(expr);
-    return cons(interp->syms.let, cons(compile_let_varlist(varlist, ctxt), compile_list(body, ctxt)));
+    GC_PROTECT(expr);
+    lisp_object_t varlist = compile_let_varlist(cadr(expr), ctxt);
+    GC_PROTECT(varlist);
+    lisp_object_t body = compile_list(cddr(expr), ctxt);
+    lisp_object_t rest = cons_if_changed(cdr(expr), varlist, body);
+    return cons_if_changed(expr, car(expr), rest);
+}
+
+/* Self-evaluating forms and quoted data, which a backquote template can
+   share rather than build */
+static int constant_form_p(lisp_object_t form)
+{
+    if (consp(form) != NIL)
+        return car(form) == interp->syms.quote;
+    return symbolp(form) == NIL || form == NIL || form == T;
+}
+
+static lisp_object_t constant_form_value(lisp_object_t form)
+{
+    return consp(form) != NIL ? cadr(form) : form;
+}
+
+static lisp_object_t quote_form(lisp_object_t x)
+{
+    if (consp(x) != NIL || (symbolp(x) != NIL && x != NIL && x != T))
+        return List(interp->syms.quote, x);
+    return x;
+}
+
+/* Makes a form that conses the values of first and rest, where x is
+   the part of the template they came from */
+static lisp_object_t quasiquote_cons(lisp_object_t x, lisp_object_t first, lisp_object_t rest)
+{
+    if (constant_form_p(first) && constant_form_p(rest)) {
+        lisp_object_t car_value = constant_form_value(first);
+        lisp_object_t cdr_value = constant_form_value(rest);
+        if (car_value == car(x) && cdr_value == cdr(x))
+            return quote_form(x);
+        return quote_form(cons(car_value, cdr_value));
+    }
+    if (rest == NIL)
+        return List(interp->syms.list, first);
+    if (consp(rest) != NIL && car(rest) == interp->syms.list) {
+        lisp_object_t args = cons(first, cdr(rest));
+        return cons(interp->syms.list, args);
+    }
+    return List(interp->syms.cons, first, rest);
+}
+
+/* Translates the template of a backquote into calls to cons, list and
+   append, so that only the parts that vary are built at run time.  The
+   list that an unquote-splice at the end of a list evaluates to is
+   shared with the result, as in Common Lisp */
+static lisp_object_t expand_quasiquote(lisp_object_t x, int depth)
+{
+    if (consp(x) == NIL)
+        return quote_form(x);
+    GC_PROTECT(x);
+    lisp_object_t head = car(x);
+    if (head == interp->syms.quasiquote || (depth > 0 && (head == interp->syms.unquote || head == interp->syms.unquote_splice))) {
+        lisp_object_t expanded = expand_quasiquote(cadr(x), head == interp->syms.quasiquote ? depth + 1 : depth - 1);
+        lisp_object_t rest = quasiquote_cons(cdr(x), expanded, NIL);
+        GC_PROTECT(rest);
+        lisp_object_t first = quote_form(car(x));
+        return quasiquote_cons(x, first, rest);
+    }
+    if (head == interp->syms.unquote)
+        return cadr(x);
+    if (head == interp->syms.unquote_splice)
+        return raise_condition("runtime-error", sym("comma-at-not-inside-list"));
+    if (depth == 0 && consp(head) != NIL && car(head) == interp->syms.unquote_splice) {
+        lisp_object_t rest = expand_quasiquote(cdr(x), depth);
+        if (rest == NIL)
+            return cadar(x);
+        if (consp(rest) != NIL && car(rest) == interp->syms.append) {
+            lisp_object_t args = cons(cadar(x), cdr(rest));
+            return cons(interp->syms.append, args);
+        }
+        return List(interp->syms.append, cadar(x), rest);
+    }
+    lisp_object_t first = expand_quasiquote(head, depth);
+    GC_PROTECT(first);
+    lisp_object_t rest = expand_quasiquote(cdr(x), depth);
+    return quasiquote_cons(x, first, rest);
+}
+
+/* Optimization
+
+   A source-to-source pass run before either compiler.  It folds calls
+   to pure built-ins whose arguments are constant, substitutes the
+   values of constants, drops the arms of an if whose test is constant
+   and the forms of a progn whose values are unused and that have no
+   effects.  In the definitions of global functions it also inlines
+   calls to small functions (see optimize_definition()).  Like
+   compile(), it expands macros as it goes and only allocates where its
+   result differs from its input.
+
+   Where inlining is allowed, inlining points to the state below;
+   otherwise it is NULL.  Calls that are folded, rewritten to a
+   two-argument function or compiled to an instruction count as
+   inlined too, as they also depend on how the function is defined
+   when the definition is compiled.  Code outside the definitions of
+   global functions is compiled once, so it keeps the definitions it
+   was compiled with. */
+
+struct inlining {
+    /* The names of the functions inlined */
+    lisp_object_t inlined;
+    /* The parameters of the definition that may be substituted for
+       those of an inlined function, and those that have been */
+    lisp_object_t stable;
+    lisp_object_t substituted;
+};
+
+#define GC_PROTECT_INLINING(inlining)     \
+    GC_PROTECT((inlining).inlined);       \
+    GC_PROTECT((inlining).stable);        \
+    GC_PROTECT((inlining).substituted)
+
+static lisp_object_t optimize(lisp_object_t expr, struct inlining *inlining);
+static int open_coded_p(lisp_object_t name);
+static lisp_object_t inline_call(lisp_object_t call, lisp_object_t expansion, struct inlining *inlining);
+static int list_length(lisp_object_t list);
+
+static void record_inlined(lisp_object_t name, struct inlining *inlining)
+{
+    if (inlining && !memberp(name, inlining->inlined))
+        inlining->inlined = cons(name, inlining->inlined);
+}
+
+static lisp_object_t optimize_list(lisp_object_t list, struct inlining *inlining)
+{
+    if (consp(list) == NIL)
+        return list;
+    GC_PROTECT(list);
+    lisp_object_t first = optimize(car(list), inlining);
+    GC_PROTECT(first);
+    lisp_object_t rest = optimize_list(cdr(list), inlining);
+    return cons_if_changed(list, first, rest);
+}
+
+/* Nested progns are spliced into the body, and constants are dropped
+   from it unless they are its value */
+static lisp_object_t optimize_body(lisp_object_t body, struct inlining *inlining)
+{
+    if (consp(body) == NIL)
+        return body;
+    GC_PROTECT(body);
+    lisp_object_t first = optimize(car(body), inlining);
+    GC_PROTECT(first);
+    lisp_object_t rest = optimize_body(cdr(body), inlining);
+    GC_PROTECT(rest);
+    if (rest != NIL && constant_form_p(first))
+        return rest;
+    if (consp(first) != NIL && car(first) == interp->syms.progn) {
+        lisp_object_t forms = NIL;
+        GC_PROTECT(forms);
+        lisp_object_t x = cdr(first);
+        GC_PROTECT(x);
+        for (; x != NIL; x = cdr(x))
+            forms = cons(car(x), forms);
+        for (; forms != NIL; forms = cdr(forms))
+            rest = cons(car(forms), rest);
+        return rest;
+    }
+    return cons_if_changed(body, first, rest);
+}
+
+static lisp_object_t optimize_progn(lisp_object_t expr, struct inlining *inlining)
+{
+    GC_PROTECT(expr);
+    lisp_object_t body = optimize_body(cdr(expr), inlining);
+    if (body == NIL)
+        return NIL;
+    if (cdr(body) == NIL)
+        return car(body);
+    return cons_if_changed(expr, car(expr), body);
+}
+
+static lisp_object_t optimize_if(lisp_object_t expr, struct inlining *inlining)
+{
+    GC_PROTECT(expr);
+    lisp_object_t test = optimize(cadr(expr), inlining);
+    if (constant_form_p(test))
+        return optimize(constant_form_value(test) != NIL ? caddr(expr) : car(cdr(cddr(expr))), inlining);
+    GC_PROTECT(test);
+    lisp_object_t rest = optimize_list(cddr(expr), inlining);
+    rest = cons_if_changed(cdr(expr), test, rest);
+    return cons_if_changed(expr, car(expr), rest);
+}
+
+static lisp_object_t optimize_let_varlist(lisp_object_t varlist, struct inlining *inlining)
+{
+    if (varlist == NIL)
+        return NIL;
+    GC_PROTECT(varlist);
+    lisp_object_t rest = optimize_let_varlist(cdr(varlist), inlining);
+    GC_PROTECT(rest);
+    lisp_object_t first = car(varlist);
+    GC_PROTECT(first);
+    if (consp(first) != NIL) {
+        lisp_object_t forms = optimize_list(cdr(first), inlining);
+        first = cons_if_changed(first, car(first), forms);
+    }
+    return cons_if_changed(varlist, first, rest);
+}
+
+/* A statement that becomes a constant is dropped, and one that becomes
+   a variable reference is put in a progn so that it is not taken for a
+   tag */
+static lisp_object_t optimize_tagbody(lisp_object_t body, struct inlining *inlining)
+{
+    if (body == NIL)
+        return NIL;
+    GC_PROTECT(body);
+    lisp_object_t rest = optimize_tagbody(cdr(body), inlining);
+    GC_PROTECT(rest);
+    lisp_object_t statement = car(body);
+    if (symbolp(statement) == NIL) {
+        lisp_object_t optimized = optimize(statement, inlining);
+        if (constant_form_p(optimized))
+            return rest;
+        statement = consp(optimized) != NIL ? optimized : List(interp->syms.progn, optimized);
+    }
+    return cons_if_changed(body, statement, rest);
 }
 
-static lisp_object_t compile_quasiquote_list(lisp_object_t expr, struct lexical_context *ctxt, int depth);
+/* The call is left alone if it raises any condition, which it then
+   does at run time, if it is ever made */
+static lisp_object_t fold_call(lisp_object_t expr)
+{
+    lisp_object_t function = SymbolPtr(car(expr))->function;
+    if (functionp(function) == NIL || LispFunctionPtr(function)->kind != interp->syms.built_in_function)
+        return expr;
+    if (!(NativeFunctionPtr(function)->flags & NATIVE_PURE))
+        return expr;
+    int nargs = 0;
+    for (lisp_object_t x = cdr(expr); x != NIL; x = cdr(x)) {
+        if (nargs == NATIVE_MAX_ARITY || !constant_form_p(car(x)))
+            return expr;
+        nargs++;
+    }
+    GC_PROTECT(expr);
+    push_condition_case_context(T);
+    if (__builtin_setjmp(interp->return_stack->buf)) {
+        pop_return_context();
+        return expr;
+    }
+    /* The arguments go on the VM stack, where the collector sees them */
+    size_t base = interp->vm_sp;
+    for (lisp_object_t x = cdr(expr); x != NIL; x = cdr(x)) {
+        if (interp->vm_sp == VM_STACK_SIZE)
+            return raise_condition("stack-overflow", NIL);
+        interp->vm_stack[interp->vm_sp++] = constant_form_value(car(x));
+    }
+    lisp_object_t value = call_native_function(SymbolPtr(car(expr))->function, nargs, interp->vm_stack + base, NIL);
+    interp->vm_sp = base;
+    pop_return_context();
+    return quote_form(value);
+}
 
-static lisp_object_t compile_quasiquote(lisp_object_t expr, struct lexical_context *ctxt, int depth)
+static lisp_object_t optimize(lisp_object_t expr, struct inlining *inlining)
 {
-    if (consp(expr) == NIL) {
+    expr = macroexpand(expr, NIL);
+    GC_PROTECT(expr);
+    if (atom(expr) != NIL) {
+        if (symbolp(expr) != NIL && expr != NIL && expr != T && SymbolIsConstant(expr))
+            return quote_form(SymbolPtr(expr)->value);
         return expr;
-    } else if (symbolp(car(expr)) != NIL) {
-        lisp_object_t symbol = car(expr);
-        if (symbol == interp->syms.unquote) {
-            if (depth == 0)
-                return List(interp->syms.unquote, compile(cadr(expr), ctxt));
-            else
-                return List(interp->syms.unquote, compile_quasiquote(cadr(expr), ctxt, depth - 1));
-        } else if (symbol == interp->syms.quasiquote) {
-            return List(interp->syms.quasiquote, compile_quasiquote(cadr(expr), ctxt, depth + 1));
-        } else {
-            return cons(symbol, compile_quasiquote_list(cdr(expr), ctxt, depth));
+    } else if (symbolp(car(expr)) == NIL || car(expr) == NIL || car(expr) == T) {
+        return expr;
+    }
+    switch (SymbolSpecialForm(car(expr))) {
+    case SPECIAL_FORM_QUOTE:
+    case SPECIAL_FORM_GO:
+    case SPECIAL_FORM_UNQUOTE:
+    case SPECIAL_FORM_DECLARE:
+        return expr;
+    case SPECIAL_FORM_QUASIQUOTE:
+        return optimize(expand_quasiquote(cadr(expr), 0), inlining);
+    case SPECIAL_FORM_IF:
+        return optimize_if(expr, inlining);
+    case SPECIAL_FORM_PROGN:
+        return optimize_progn(expr, inlining);
+    case SPECIAL_FORM_LET: {
+        lisp_object_t varlist = optimize_let_varlist(cadr(expr), inlining);
+        GC_PROTECT(varlist);
+        lisp_object_t body = optimize_body(cddr(expr), inlining);
+        lisp_object_t rest = cons_if_changed(cdr(expr), varlist, body);
+        return cons_if_changed(expr, car(expr), rest);
+    }
+    case SPECIAL_FORM_BLOCK:
+    case SPECIAL_FORM_RETURN_FROM:
+    case SPECIAL_FORM_SET: {
+        /* The first operand is a name */
+        lisp_object_t forms = SymbolSpecialForm(car(expr)) == SPECIAL_FORM_BLOCK ? optimize_body(cddr(expr), inlining) : optimize_list(cddr(expr), inlining);
+        lisp_object_t rest = cons_if_changed(cdr(expr), cadr(expr), forms);
+        return cons_if_changed(expr, car(expr), rest);
+    }
+    case SPECIAL_FORM_TAGBODY: {
+        lisp_object_t body = optimize_tagbody(cdr(expr), inlining);
+        return cons_if_changed(expr, car(expr), body);
+    }
+    case SPECIAL_FORM_CONDITION_CASE: {
+        lisp_object_t body = optimize(caddr(expr), inlining);
+        GC_PROTECT(body);
+        lisp_object_t clauses = optimize_let_varlist(cdr(cddr(expr)), inlining);
+        lisp_object_t rest = cons_if_changed(cddr(expr), body, clauses);
+        rest = cons_if_changed(cdr(expr), cadr(expr), rest);
+        return cons_if_changed(expr, car(expr), rest);
+    }
+    case SPECIAL_FORM_FUNCTION: {
+        if (symbolp(cadr(expr)) != NIL)
+            return expr;
+        /* A closure could outlive a recompilation of the function
+           that made it, so nothing is inlined into one */
+        lisp_object_t body = optimize_body(cddr(cadr(expr)), NULL);
+        lisp_object_t function = cadr(expr);
+        GC_PROTECT(function);
+        lisp_object_t lambda = cons_if_changed(cdr(function), cadr(function), body);
+        lambda = cons_if_changed(function, car(function), lambda);
+        lisp_object_t rest = cons_if_changed(cdr(expr), lambda, cddr(expr));
+        return cons_if_changed(expr, car(expr), rest);
+    }
+    default: {
+        lisp_object_t args = optimize_list(cdr(expr), inlining);
+        lisp_object_t call = cons_if_changed(expr, car(expr), args);
+        GC_PROTECT(call);
+        /* e.g. + called with two arguments is two-arg-plus */
+        lisp_object_t two_arg_function = getprop(car(call), interp->syms.two_arg_function);
+        if (two_arg_function != NIL && list_length(cdr(call)) == 2) {
+            GC_PROTECT(two_arg_function);
+            record_inlined(car(call), inlining);
+            call = cons(two_arg_function, cdr(call));
         }
-    } else {
-        return compile_quasiquote_list(expr, ctxt, depth);
+        lisp_object_t expansion = getprop(car(call), interp->syms.inline_expansion);
+        if (inlining && expansion != NIL && list_length(cdr(call)) == list_length(cadr(expansion)))
+            return inline_call(call, expansion, inlining);
+        lisp_object_t folded = fold_call(call);
+        GC_PROTECT(folded);
+        if (folded != call || open_coded_p(car(call)))
+            record_inlined(car(call), inlining);
+        return folded;
+    }
     }
 }
 
-static lisp_object_t compile_quasiquote_list(lisp_object_t expr, struct lexical_context *ctxt, int depth)
+/* Inlining
+
+   A global function defined at toplevel gets an inline expansion when
+   its body is small and only refers to its parameters, so that
+   substituting it for a call cannot capture variables at the call
+   site.  The expansion is kept on the plist of the function's name,
+   and %define-function in lisp.c records each function that has it
+   inlined, which is recompiled when the name is redefined. */
+
+#define INLINE_SIZE_LIMIT 16
+
+static int list_length(lisp_object_t list)
 {
-    if (expr == NIL)
+    int n = 0;
+    for (; consp(list) != NIL; list = cdr(list))
+        n++;
+    return n;
+}
+
+static int form_size(lisp_object_t x)
+{
+    if (consp(x) == NIL)
+        return 1;
+    return form_size(car(x)) + form_size(cdr(x));
+}
+
+/* Recursive functions are not inlined, as their expansion would call
+   itself */
+static int inlinable_form_p(lisp_object_t e, lisp_object_t params, lisp_object_t name)
+{
+    if (constant_form_p(e))
+        return 1;
+    if (atom(e) != NIL)
+        return memberp(e, params);
+    if (symbolp(car(e)) == NIL || car(e) == NIL || car(e) == T || car(e) == name)
+        return 0;
+    lisp_object_t forms = cdr(e);
+    switch (SymbolSpecialForm(car(e))) {
+    case SPECIAL_FORM_NONE:
+    case SPECIAL_FORM_IF:
+    case SPECIAL_FORM_PROGN:
+        break;
+    case SPECIAL_FORM_BLOCK:
+    case SPECIAL_FORM_RETURN_FROM:
+        forms = cddr(e);
+        break;
+    default:
+        return 0;
+    }
+    for (; forms != NIL; forms = cdr(forms))
+        if (!inlinable_form_p(car(forms), params, name))
+            return 0;
+    return 1;
+}
+
+/* The block that defun wraps around the body is dropped when nothing
+   returns from it */
+static lisp_object_t inline_expansion(lisp_object_t name, lisp_object_t lambda)
+{
+    lisp_object_t params = cadr(lambda);
+    lisp_object_t body = cddr(lambda);
+    for (lisp_object_t x = params; x != NIL; x = cdr(x)) {
+        lisp_object_t param = car(x);
+        if (symbolp(param) == NIL || param == NIL || param == T)
+            return NIL;
+        if (param == interp->syms.amprest || param == interp->syms.ampbody || param == interp->syms.ampoptional)
+            return NIL;
+    }
+    if (form_size(body) > INLINE_SIZE_LIMIT)
         return NIL;
-    else
-        return cons(compile_quasiquote(car(expr), ctxt, depth), compile_quasiquote_list(cdr(expr), ctxt, depth));
+    for (lisp_object_t x = body; x != NIL; x = cdr(x))
+        if (!inlinable_form_p(car(x), params, name))
+            return NIL;
+    if (cdr(body) == NIL && consp(car(body)) != NIL && car(car(body)) == interp->syms.block
+        && !find_return_from(cddr(car(body)), cadr(car(body)), 0))
+        body = cddr(car(body));
+    lisp_object_t rest = cons(params, body);
+    return cons(interp->syms.lambda, rest);
 }
 
-static lisp_object_t compile_tagbody(lisp_object_t expr, struct lexical_context *ctxt)
+/* Replaces the parameters in the body of an expansion, which only has
+   the forms allowed by inlinable_form_p() */
+static lisp_object_t substitute_parameters(lisp_object_t e, lisp_object_t alist);
+
+static lisp_object_t substitute_parameters_list(lisp_object_t forms, lisp_object_t alist)
 {
-    if (expr == NIL)
+    if (forms == NIL)
         return NIL;
-    else if (symbolp(car(expr)) != NIL)
-        return cons(car(expr), compile_tagbody(cdr(expr), ctxt));
-    else
-        return cons(compile(car(expr), ctxt), compile_tagbody(cdr(expr), ctxt));
+    GC_PROTECT(forms);
+    GC_PROTECT(alist);
+    lisp_object_t first = substitute_parameters(car(forms), alist);
+    GC_PROTECT(first);
+    lisp_object_t rest = substitute_parameters_list(cdr(forms), alist);
+    return cons(first, rest);
 }
 
-static lisp_object_t compile_if(lisp_object_t expr, struct lexical_context *ctxt)
+static lisp_object_t substitute_parameters(lisp_object_t e, lisp_object_t alist)
 {
-    lisp_object_t test_form = cadr(expr);
-    lisp_object_t then_form = caddr(expr);
-    lisp_object_t else_form = cadr(cddr(expr));
-    return List(interp->syms.if_, compile(test_form, ctxt), compile(then_form, ctxt), compile(else_form, ctxt));
+    if (atom(e) != NIL) {
+        lisp_object_t binding = assoc(e, alist);
+        return binding != NIL ? cdr(binding) : e;
+    }
+    if (car(e) == interp->syms.quote)
+        return e;
+    GC_PROTECT(e);
+    if (car(e) == interp->syms.block || car(e) == interp->syms.return_from) {
+        lisp_object_t forms = substitute_parameters_list(cddr(e), alist);
+        forms = cons(cadr(e), forms);
+        return cons(car(e), forms);
+    }
+    lisp_object_t forms = substitute_parameters_list(cdr(e), alist);
+    return cons(car(e), forms);
+}
+
+/* Constant arguments are substituted for their parameters, as are
+   the parameters of the definition that nothing assigns, as reading
+   them later gives the same value.  The rest, specials included, are
+   bound to their parameters by a let, which evaluates them in order
+   before the body. */
+static lisp_object_t inline_call(lisp_object_t call, lisp_object_t expansion, struct inlining *inlining)
+{
+    GC_PROTECT(call);
+    GC_PROTECT(expansion);
+    lisp_object_t alist = NIL;
+    GC_PROTECT(alist);
+    lisp_object_t bindings = NIL;
+    GC_PROTECT(bindings);
+    lisp_object_t args = cdr(call);
+    GC_PROTECT(args);
+    lisp_object_t params = cadr(expansion);
+    GC_PROTECT(params);
+    for (; params != NIL; params = cdr(params), args = cdr(args)) {
+        int stable = symbolp(car(args)) != NIL && memberp(car(args), inlining->stable);
+        if (stable && !memberp(car(args), inlining->substituted))
+            inlining->substituted = cons(car(args), inlining->substituted);
+        if (stable || constant_form_p(car(args))) {
+            lisp_object_t binding = cons(car(params), car(args));
+            alist = cons(binding, alist);
+        } else {
+            lisp_object_t binding = List(car(params), car(args));
+            bindings = cons(binding, bindings);
+        }
+    }
+    lisp_object_t varlist = NIL;
+    GC_PROTECT(varlist);
+    for (; bindings != NIL; bindings = cdr(bindings))
+        varlist = cons(car(bindings), varlist);
+    lisp_object_t body = cons(interp->syms.progn, cddr(expansion));
+    GC_PROTECT(body);
+    body = substitute_parameters(body, alist);
+    if (varlist != NIL)
+        body = List(interp->syms.let, varlist, body);
+    record_inlined(car(call), inlining);
+    /* The expansion was optimized when it was made, but the arguments
+       may now let more be folded */
+    return optimize(body, NULL);
+}
+
+/* Whether e may assign var: a set of it, or of an inner variable of
+   the same name, or of a place only known at run time */
+static int assigns_p(lisp_object_t e, lisp_object_t var)
+{
+    if (atom(e) != NIL || car(e) == interp->syms.quote)
+        return 0;
+    if (car(e) == interp->syms.set) {
+        lisp_object_t place = cadr(e);
+        if (consp(place) == NIL || car(place) != interp->syms.quote || cadr(place) == var)
+            return 1;
+    }
+    for (; consp(e) != NIL; e = cdr(e))
+        if (assigns_p(car(e), var))
+            return 1;
+    return 0;
+}
+
+/* The parameters that are not special, which inline_call() may
+   substitute for those of an inlined function */
+static lisp_object_t lexical_parameters(lisp_object_t params)
+{
+    GC_PROTECT(params);
+    lisp_object_t result = NIL;
+    GC_PROTECT(result);
+    for (; params != NIL; params = cdr(params)) {
+        lisp_object_t param = car(params);
+        if (symbolp(param) == NIL || param == NIL || param == T || SymbolIsSpecial(param))
+            continue;
+        if (param == interp->syms.amprest || param == interp->syms.ampbody || param == interp->syms.ampoptional)
+            continue;
+        result = cons(param, result);
+    }
+    return result;
+}
+
+/* Whether a parameter is assigned is only known once the body has been
+   expanded, so the ones that were substituted and turn out to be are
+   dropped from those that may be, and the result is whether there were
+   any */
+static int drop_assigned_parameters(lisp_object_t body, struct inlining *inlining)
+{
+    GC_PROTECT(body);
+    lisp_object_t kept = NIL;
+    GC_PROTECT(kept);
+    lisp_object_t x = inlining->stable;
+    GC_PROTECT(x);
+    int dropped = 0;
+    for (; x != NIL; x = cdr(x)) {
+        if (memberp(car(x), inlining->substituted) && assigns_p(body, car(x)))
+            dropped = 1;
+        else
+            kept = cons(car(x), kept);
+    }
+    inlining->stable = kept;
+    return dropped;
 }
 
+/* Optimizes a definition made by defun and rewrites it to call
+   %define-function where there is something to record.  Calls are
+   only inlined into these, as it is the definition that is recompiled
+   when an inlined function changes. */
+static lisp_object_t optimize_definition(lisp_object_t expr)
+{
+    GC_PROTECT(expr);
+    struct inlining inlining;
+    inlining.inlined = NIL;
+    inlining.stable = NIL;
+    inlining.substituted = NIL;
+    GC_PROTECT_INLINING(inlining);
+    inlining.stable = lexical_parameters(cadr(cadr(caddr(expr))));
+    lisp_object_t body = optimize_body(cddr(cadr(caddr(expr))), &inlining);
+    GC_PROTECT(body);
+    while (drop_assigned_parameters(body, &inlining)) {
+        inlining.inlined = NIL;
+        inlining.substituted = NIL;
+        body = optimize_body(cddr(cadr(caddr(expr))), &inlining);
+    }
+    lisp_object_t function = caddr(expr);
+    GC_PROTECT(function);
+    lisp_object_t lambda = cadr(function);
+    GC_PROTECT(lambda);
+    body = cons_if_changed(cdr(lambda), cadr(lambda), body);
+    lambda = cons_if_changed(lambda, car(lambda), body);
+    lisp_object_t rest = cons_if_changed(cdr(function), lambda, cddr(function));
+    function = cons_if_changed(function, car(function), rest);
+    lisp_object_t expansion = inline_expansion(cadr(cadr(expr)), lambda);
+    if (expansion == NIL && inlining.inlined == NIL) {
+        rest = cons_if_changed(cddr(expr), function, NIL);
+        rest = cons_if_changed(cdr(expr), cadr(expr), rest);
+        return cons_if_changed(expr, car(expr), rest);
+    }
+    GC_PROTECT(expansion);
+    lisp_object_t quoted_expansion = quote_form(expansion);
+    GC_PROTECT(quoted_expansion);
+    lisp_object_t quoted_inlined = quote_form(inlining.inlined);
+    GC_PROTECT(quoted_inlined);
+    lisp_object_t quoted_expr = quote_form(expr);
+    GC_PROTECT(quoted_expr);
+    lisp_object_t args = List(cadr(expr), function, quoted_expansion, quoted_inlined, quoted_expr);
+    return cons(interp->syms.define_function, args);
+}
+
+static int definition_p(lisp_object_t expr)
+{
+    if (consp(expr) == NIL || car(expr) != sym("set-symbol-function") || list_length(expr) != 3)
+        return 0;
+    lisp_object_t name = cadr(expr);
+    lisp_object_t function = caddr(expr);
+    if (consp(name) == NIL || car(name) != interp->syms.quote || symbolp(cadr(name)) == NIL || cadr(name) == NIL || cadr(name) == T)
+        return 0;
+    if (consp(function) == NIL || car(function) != interp->syms.function || consp(cadr(function)) == NIL)
+        return 0;
+    return car(cadr(function)) == interp->syms.lambda;
+}
+
+static lisp_object_t optimize_toplevel(lisp_object_t expr)
+{
+    expr = macroexpand(expr, NIL);
+    if (definition_p(expr))
+        return optimize_definition(expr);
+    return optimize(expr, NULL);
+}
+
+static lisp_object_t compile_tagbody(lisp_object_t expr, struct lexical_context *ctxt)
+{
+    if (expr == NIL)
+        return NIL;
+    GC_PROTECT(expr);
+    lisp_object_t statement = car(expr);
+    GC_PROTECT(statement);
+    if (symbolp(statement) == NIL)
+        statement = compile(statement, ctxt);
+    lisp_object_t rest = compile_tagbody(cdr(expr), ctxt);
+    return cons_if_changed(expr, statement, rest);
+}
+
+/* The body is expanded as it is compiled, so whether it returns from
+   the block is only known afterwards */
 static lisp_object_t compile_block(lisp_object_t expr, struct lexical_context *ctxt)
 {
-    lisp_object_t block_name = cadr(expr);
-    lisp_object_t block_number = lexical_context_enter_block(ctxt, block_name);
-    lisp_object_t body = cddr(expr);
-    lisp_object_t compiled_body = compile_list(body, ctxt);
+    GC_PROTECT(expr);
+    lisp_object_t block_number = lexical_context_enter_block(ctxt, cadr(expr));
+    lisp_object_t compiled_body = compile_list(cddr(expr), ctxt);
+    /* Nothing needs undoing on a non-local exit from the body: the
+       context belongs to a single call of compile_toplevel(), and no
+       condition is handled between here and its caller, so the exit
+       abandons the context along with the rest of the compilation */
+    lexical_context_leave_block(ctxt, cadr(expr));
     lisp_object_t progn = cons(interp->syms.progn, compiled_body);
-    lisp_object_t result = List(interp->syms.pctblock, block_number, List(sym("raise"), block_number, progn));
-    // Should we try to guarantee this clean-up happens?
-    // Maybe not needed since it will bail the entire compilation?
-    lexical_context_leave_block(ctxt, block_name);
-    return result;
+    if (assoc(block_number, ctxt->returned_blocks) == NIL)
+        return progn;
+    GC_PROTECT(progn);
+    lisp_object_t inner = List(interp->syms.raise, block_number, progn);
+    return List(interp->syms.pctblock, block_number, inner);
 }
 
+/* Macros are expanded as they are reached, here and in the optimizer
+   that runs first, so there is no separate macroexpand_all() pass */
 static lisp_object_t compile(lisp_object_t expr, struct lexical_context *ctxt)
 {
+    expr = macroexpand(expr, NIL);
+    GC_PROTECT(expr);
     if (atom(expr) != NIL) {
         // With lexical scope we will do something interesting here
         return expr;
     } else if (symbolp(car(expr)) != NIL) {
-        lisp_object_t symbol = car(expr);
-        if (symbol == interp->syms.block) {
+        switch (SymbolSpecialForm(car(expr))) {
+        case SPECIAL_FORM_BLOCK:
             return compile_block(expr, ctxt);
-        } else if (symbol == interp->syms.return_from) {
-            lisp_object_t block_name = cadr(expr);
-            lisp_object_t x = assoc(block_name, ctxt->block_alist);
+        case SPECIAL_FORM_RETURN_FROM: {
+            lisp_object_t x = assoc(cadr(expr), ctxt->block_alist);
             if (x == NIL)
-                return raise(sym("return-for-unknown-block"), block_name);
-            else
-                return List(sym("raise"), cdr(x), compile(caddr(expr), ctxt));
-        } else if (symbol == interp->syms.quote) {
+                return raise_condition("return-for-unknown-block", cadr(expr));
+            /* Block numbers are fixnums, so they need no protection */
+            lisp_object_t block_number = cdr(x);
+            if (assoc(block_number, ctxt->returned_blocks) == NIL) {
+                lisp_object_t entry = cons(block_number, T);
+                ctxt->returned_blocks = cons(entry, ctxt->returned_blocks);
+            }
+            lisp_object_t value = compile(caddr(expr), ctxt);
+            return List(interp->syms.raise, block_number, value);
+        }
+        case SPECIAL_FORM_QUOTE:
+        case SPECIAL_FORM_DECLARE:
             return expr;
-        } else if (symbol == interp->syms.quasiquote) {
-            return List(interp->syms.quasiquote, compile_quasiquote(cadr(expr), ctxt, 0));
-        } else if (symbol == interp->syms.unquote) {
-            return raise(sym("runtime-error"), sym("comma-not-inside-backquote"));
-        } else if (symbol == interp->syms.if_) {
-            return compile_if(expr, ctxt);
-        } else if (symbol == interp->syms.let) {
+        case SPECIAL_FORM_QUASIQUOTE:
+            return compile(expand_quasiquote(cadr(expr), 0), ctxt);
+        case SPECIAL_FORM_UNQUOTE:
+            return raise_condition("runtime-error", sym("comma-not-inside-backquote"));
+        case SPECIAL_FORM_LET:
             return compile_let(expr, ctxt);
-        } else if (symbol == interp->syms.set) {
-            return List(interp->syms.set, cadr(expr), compile(car(cddr(expr)), ctxt));
-        } else if (symbol == interp->syms.progn) {
-            return cons(interp->syms.progn, compile_list(cdr(expr), ctxt));
-        } else if (symbol == interp->syms.tagbody) {
-            return cons(interp->syms.tagbody, compile_tagbody(cdr(expr), ctxt));
-        } else if (symbol == interp->syms.go) {
+        case SPECIAL_FORM_SET: {
+            lisp_object_t forms = compile_list(cddr(expr), ctxt);
+            lisp_object_t rest = cons_if_changed(cdr(expr), cadr(expr), forms);
+            return cons_if_changed(expr, car(expr), rest);
+        }
+        case SPECIAL_FORM_TAGBODY:
+            return lower_tagbody(compile_tagbody(cdr(expr), ctxt));
+        case SPECIAL_FORM_GO:
             // Nothing to do here
             return expr;
-        } else if (symbol == interp->syms.condition_case) {
-            lisp_object_t exc = cadr(expr);
-            lisp_object_t body = caddr(expr);
-            lisp_object_t clauses = cdr(cddr(expr));
-            return cons(interp->syms.condition_case, cons(exc, cons(compile(body, ctxt), compile_let_varlist(clauses, ctxt))));
-        } else if (symbol == interp->syms.function) {
-            lisp_object_t function = cadr(expr);
-            if (symbolp(function) != NIL) {
+        case SPECIAL_FORM_CONDITION_CASE: {
+            lisp_object_t compiled_body = compile(caddr(expr), ctxt);
+            GC_PROTECT(compiled_body);
+            lisp_object_t compiled_clauses = compile_let_varlist(cdr(cddr(expr)), ctxt);
+            lisp_object_t rest = cons_if_changed(cddr(expr), compiled_body, compiled_clauses);
+            rest = cons_if_changed(cdr(expr), cadr(expr), rest);
+            return cons_if_changed(expr, car(expr), rest);
+        }
+        case SPECIAL_FORM_FUNCTION: {
+            if (symbolp(cadr(expr)) != NIL) {
                 return expr;
             } else {
-                lisp_object_t arglist = cadr(function);
-                lisp_object_t body = cddr(function);
-                return List(interp->syms.function, cons(interp->syms.lambda, cons(arglist, compile_list(body, ctxt))));
+                lisp_object_t body = compile_list(cddr(cadr(expr)), ctxt);
+                lisp_object_t function = cadr(expr);
+                GC_PROTECT(function);
+                lisp_object_t lambda = cons_if_changed(cdr(function), cadr(function), body);
+                lambda = cons_if_changed(function, car(function), lambda);
+                lisp_object_t rest = cons_if_changed(cdr(expr), lambda, cddr(expr));
+                return cons_if_changed(expr, car(expr), rest);
             }
-        } else {
-            return cons(car(expr), compile_list(cdr(expr), ctxt));
+        }
+        default: {
+            /* Function calls, if and progn */
+            lisp_object_t args = compile_list(cdr(expr), ctxt);
+            return cons_if_changed(expr, car(expr), args);
+        }
         }
     } else {
-        return raise(sym("bad-expression"), expr);
+        return raise_condition("bad-expression", expr);
     }
 }
 
@@ -189,5 +946,818 @@ lisp_object_t compile_toplevel(lisp_object_t expr)
 {
     struct lexical_context ctxt;
     lexical_context_init(&ctxt);
-    return compile(expr, &ctxt);
-}
\ No newline at end of file
+    GC_PROTECT_LEXICAL_CONTEXT(ctxt);
+    return compile(optimize_toplevel(expr), &ctxt);
+}
+
+/* Bytecode compilation */
+
+struct assembler {
+    lisp_object_t bytecode; /* a string used as a growable byte buffer */
+    size_t length;
+    lisp_object_t constants; /* in reverse order */
+    size_t constants_length;
+    int depth;
+    int max_depth;
+    int contexts; /* return contexts pushed by the code at this point */
+};
+
+/* As for a lexical context, once it has been initialized */
+#define GC_PROTECT_ASSEMBLER(as) \
+    GC_PROTECT((as).bytecode);   \
+    GC_PROTECT((as).constants)
+
+static void assembler_init(struct assembler *as)
+{
+    as->bytecode = allocate_blank_string(64);
+    as->length = 0;
+    as->constants = NIL;
+    as->constants_length = 0;
+    as->depth = 0;
+    as->max_depth = 0;
+    as->contexts = 0;
+}
+
+static unsigned char *assembler_bytes(struct assembler *as)
+{
+    size_t len;
+    char *str;
+    get_string_parts(as->bytecode, &len, &str);
+    return (unsigned char *)str;
+}
+
+static void emit_byte(struct assembler *as, int byte)
+{
+    size_t capacity;
+    char *str;
+    get_string_parts(as->bytecode, &capacity, &str);
+    if (as->length == capacity) {
+        lisp_object_t bigger = allocate_blank_string(capacity * 2);
+        size_t bigger_len;
+        char *bigger_str;
+        get_string_parts(bigger, &bigger_len, &bigger_str);
+        get_string_parts(as->bytecode, &capacity, &str);
+        memcpy(bigger_str, str, as->length);
+        as->bytecode = bigger;
+    }
+    unsigned char *p = assembler_bytes(as) + as->length++;
+    *p = byte;
+    write_barrier_bytes(p, 1);
+}
+
+static void emit_u16(struct assembler *as, size_t value)
+{
+    if (value > 0xffff)
+        raise(sym("bytecode-limit-exceeded"), value << 4);
+    emit_byte(as, value & 0xff);
+    emit_byte(as, value >> 8);
+}
+
+static void patch_u16(struct assembler *as, size_t offset, size_t value)
+{
+    if (value > 0xffff)
+        raise(sym("bytecode-limit-exceeded"), value << 4);
+    unsigned char *p = assembler_bytes(as) + offset;
+    p[0] = value & 0xff;
+    p[1] = value >> 8;
+    write_barrier_bytes(p, 2);
+}
+
+/* Every opcode is emitted with its effect on the depth of the stack so
+   that the VM can check for overflow once per call */
+static void emit_op(struct assembler *as, enum opcode op, int stack_effect)
+{
+    emit_byte(as, op);
+    as->depth += stack_effect;
+    if (as->depth > as->max_depth)
+        as->max_depth = as->depth;
+}
+
+static size_t add_constant(struct assembler *as, lisp_object_t obj)
+{
+    GC_PROTECT(obj);
+    size_t index = as->constants_length;
+    for (lisp_object_t x = as->constants; x != NIL; x = cdr(x)) {
+        index--;
+        if (car(x) == obj)
+            return index;
+    }
+    as->constants = cons(obj, as->constants);
+    return as->constants_length++;
+}
+
+static void emit_constant_operand(struct assembler *as, lisp_object_t obj)
+{
+    emit_u16(as, add_constant(as, obj));
+}
+
+static lisp_object_t assemble(struct assembler *as, lisp_object_t lambda_list)
+{
+    GC_PROTECT(lambda_list);
+    lisp_object_t bytecode = allocate_blank_string(as->length);
+    GC_PROTECT(bytecode);
+    size_t len;
+    char *str;
+    get_string_parts(bytecode, &len, &str);
+    memcpy(str, assembler_bytes(as), as->length);
+    lisp_object_t constants = allocate_vector(as->constants_length << 4);
+    GC_PROTECT(constants);
+    size_t i = as->constants_length;
+    for (lisp_object_t x = as->constants; x != NIL; x = cdr(x))
+        svref_set(constants, --i << 4, car(x));
+    lisp_object_t code = allocate_vector(CODE_SLOTS << 4);
+    GC_PROTECT(code);
+    svref_set(code, CODE_BYTECODE << 4, bytecode);
+    svref_set(code, CODE_CONSTANTS << 4, constants);
+    svref_set(code, CODE_LAMBDA_LIST << 4, lambda_list);
+    svref_set(code, CODE_MAX_STACK << 4, as->max_depth << 4);
+    lisp_object_t call_cache = allocate_vector((2 * as->constants_length) << 4);
+    svref_set(code, CODE_CALL_CACHE << 4, call_cache);
+    return code;
+}
+
+static void emit_form(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt, int tail);
+
+/* A form in tail position is one whose value the function returns
+   directly, and a call there replaces the running function rather than
+   nesting inside it */
+static void emit_progn(struct assembler *as, lisp_object_t body, struct lexical_context *ctxt, int tail)
+{
+    if (body == NIL) {
+        emit_op(as, OP_NIL, 1);
+        return;
+    }
+    GC_PROTECT(body);
+    for (; body != NIL; body = cdr(body)) {
+        if (cdr(body) != NIL && consp(car(body)) != NIL && car(car(body)) == interp->syms.declare)
+            continue;
+        emit_form(as, car(body), ctxt, tail && cdr(body) == NIL);
+        if (cdr(body) != NIL)
+            emit_op(as, OP_POP, -1);
+    }
+}
+
+static void emit_constant(struct assembler *as, lisp_object_t obj)
+{
+    GC_PROTECT(obj);
+    if (obj == NIL) {
+        emit_op(as, OP_NIL, 1);
+    } else if (obj == T) {
+        emit_op(as, OP_T, 1);
+    } else {
+        emit_op(as, OP_CONST, 1);
+        emit_constant_operand(as, obj);
+    }
+}
+
+static void emit_if(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt, int tail)
+{
+    GC_PROTECT(expr);
+    emit_form(as, cadr(expr), ctxt, 0);
+    emit_op(as, OP_JUMP_IF_NIL, -1);
+    size_t else_jump = as->length;
+    emit_u16(as, 0);
+    emit_form(as, caddr(expr), ctxt, tail);
+    emit_op(as, OP_JUMP, -1);
+    size_t end_jump = as->length;
+    emit_u16(as, 0);
+    patch_u16(as, else_jump, as->length);
+    emit_form(as, cadr(cddr(expr)), ctxt, tail);
+    patch_u16(as, end_jump, as->length);
+}
+
+/* Integer types
+
+   A variable is known to hold an integer when it is declared to with
+   (declare (fixnum var...)) at the start of the body that binds it, or
+   when a let binds it to an integer and every set of it stores one.  A
+   declared variable is checked when it is bound or set to anything not
+   known to be an integer, so calls to the integer built-ins whose
+   arguments are all known integers can skip the checks. */
+
+/* Built-in functions that the bytecode compiler emits an instruction
+   for when they are called with two arguments, with the one to use
+   when both are known to be integers */
+static struct primitive {
+    char *name;
+    enum opcode op;
+    enum opcode fixnum_op;
+    int returns_fixnum;
+} primitives[] = {
+    { "two-arg-plus", OP_ADD, OP_FIXNUM_ADD, 1 },
+    { "two-arg-minus", OP_SUB, OP_FIXNUM_SUB, 1 },
+    { "two-arg-times", OP_MUL, OP_FIXNUM_MUL, 1 },
+    { "two-arg-less-than", OP_LESS, OP_FIXNUM_LESS, 0 },
+    { "two-arg-greater-than", OP_GREATER, OP_FIXNUM_GREATER, 0 },
+    { "eq", OP_EQ, OP_EQ, 0 },
+    { "=", OP_EQ, OP_EQ, 0 },
+};
+
+/* Only while the name is still bound to the built-in function */
+static int builtin_p(lisp_object_t name, char *builtin_name)
+{
+    if (symbolp(name) == NIL || name == NIL || name == T || name != sym(builtin_name))
+        return 0;
+    lisp_object_t function = SymbolPtr(name)->function;
+    return functionp(function) != NIL && LispFunctionPtr(function)->kind == interp->syms.built_in_function
+        && NativeFunctionPtr(function)->name == name;
+}
+
+static struct primitive *find_primitive(lisp_object_t name)
+{
+    for (size_t i = 0; i < sizeof(primitives) / sizeof(primitives[0]); i++)
+        if (builtin_p(name, primitives[i].name))
+            return &primitives[i];
+    return NULL;
+}
+
+/* Whether the bytecode compiler relies on name being the built-in
+   function, either to emit an instruction for it or to know that it
+   returns an integer */
+static int open_coded_p(lisp_object_t name)
+{
+    return find_primitive(name) || builtin_p(name, "two-arg-divide") || builtin_p(name, "length");
+}
+
+/* Whether e always evaluates to an integer, given that var (if not
+   nil) holds one */
+static int fixnum_form_p(lisp_object_t e, struct lexical_context *ctxt, lisp_object_t var)
+{
+    if (integerp(e) != NIL)
+        return 1;
+    if (atom(e) != NIL)
+        return symbolp(e) != NIL && e != NIL && e != T && (e == var || (ctxt && lexical_context_fixnum_p(ctxt, e)));
+    if (builtin_p(car(e), "two-arg-divide") || builtin_p(car(e), "length"))
+        return 1;
+    struct primitive *primitive = find_primitive(car(e));
+    return primitive && primitive->returns_fixnum;
+}
+
+/* Whether every set of var in e stores an integer, given that var
+   holds one.  Sets of inner variables of the same name are included,
+   which can only make the answer no. */
+static int sets_keep_fixnum(lisp_object_t e, lisp_object_t var)
+{
+    if (atom(e) != NIL || car(e) == interp->syms.quote)
+        return 1;
+    if (car(e) == interp->syms.set) {
+        lisp_object_t place = cadr(e);
+        if (consp(place) != NIL && car(place) == interp->syms.quote && cadr(place) == var && !fixnum_form_p(caddr(e), NULL, var))
+            return 0;
+    }
+    for (; consp(e) != NIL; e = cdr(e))
+        if (!sets_keep_fixnum(car(e), var))
+            return 0;
+    return 1;
+}
+
+/* defun puts the body of a function in a block, so the declarations
+   may be at the start of that */
+static lisp_object_t declared_fixnums(lisp_object_t body)
+{
+    if (consp(body) != NIL && cdr(body) == NIL && consp(car(body)) != NIL && car(car(body)) == interp->syms.block)
+        body = cddr(car(body));
+    GC_PROTECT(body);
+    lisp_object_t vars = NIL;
+    GC_PROTECT(vars);
+    for (; consp(body) != NIL && consp(car(body)) != NIL && car(car(body)) == interp->syms.declare; body = cdr(body)) {
+        lisp_object_t specs = cdr(car(body));
+        GC_PROTECT(specs);
+        for (; specs != NIL; specs = cdr(specs)) {
+            lisp_object_t spec = car(specs);
+            if (consp(spec) == NIL || (car(spec) != interp->syms.fixnum && car(spec) != interp->syms.integer))
+                continue;
+            lisp_object_t x = cdr(spec);
+            GC_PROTECT(x);
+            for (; x != NIL; x = cdr(x))
+                vars = cons(car(x), vars);
+        }
+    }
+    return vars;
+}
+
+static void emit_let(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt, int tail)
+{
+    GC_PROTECT(expr);
+    lisp_object_t declared = declared_fixnums(cddr(expr));
+    GC_PROTECT(declared);
+    lisp_object_t vars = NIL;
+    GC_PROTECT(vars);
+    lisp_object_t fixnums = NIL;
+    GC_PROTECT(fixnums);
+    int count = 0;
+    lisp_object_t varlist = cadr(expr);
+    GC_PROTECT(varlist);
+    for (; varlist != NIL; varlist = cdr(varlist), count++) {
+        lisp_object_t entry = car(varlist);
+        lisp_object_t init = consp(entry) != NIL ? cadr(entry) : NIL;
+        emit_form(as, init, ctxt, 0);
+        entry = car(varlist);
+        init = consp(entry) != NIL ? cadr(entry) : NIL;
+        lisp_object_t var = consp(entry) != NIL ? car(entry) : entry;
+        GC_PROTECT(var);
+        int fixnum_init = fixnum_form_p(init, ctxt, NIL);
+        if (memberp(var, declared)) {
+            if (!fixnum_init)
+                emit_op(as, OP_CHECK_FIXNUM, 0);
+            fixnums = cons(var, fixnums);
+        } else if (fixnum_init && sets_keep_fixnum(cddr(expr), var)) {
+            fixnums = cons(var, fixnums);
+        }
+        vars = cons(var, vars);
+    }
+    if (count == 0) {
+        emit_progn(as, cddr(expr), ctxt, tail);
+        return;
+    }
+    if (count > 0xff)
+        raise(sym("bytecode-limit-exceeded"), count << 4);
+    /* The slots of the frame are in the same order as the values */
+    lisp_object_t ordered_vars = NIL;
+    GC_PROTECT(ordered_vars);
+    for (; vars != NIL; vars = cdr(vars))
+        ordered_vars = cons(car(vars), ordered_vars);
+    emit_op(as, OP_LET, 1 - count);
+    emit_byte(as, count);
+    lexical_context_enter_scope(ctxt, ordered_vars, fixnums);
+    emit_progn(as, cddr(expr), ctxt, tail);
+    lexical_context_leave_scope(ctxt);
+    emit_op(as, OP_UNLET, -1);
+}
+
+static void emit_numbered_block(struct assembler *as, lisp_object_t block_number, lisp_object_t body, struct lexical_context *ctxt, int tail)
+{
+    GC_PROTECT(body);
+    emit_op(as, OP_BLOCK, 1);
+    emit_constant_operand(as, block_number);
+    size_t exit = as->length;
+    emit_u16(as, 0);
+    as->contexts++;
+    emit_progn(as, body, ctxt, tail);
+    as->contexts--;
+    emit_op(as, OP_POP_CONTEXTS, -1);
+    emit_byte(as, 1);
+    patch_u16(as, exit, as->length);
+}
+
+/* A block that is only returned from by its own body needs no context
+   at run time: each return-from knows how much of the stack, how many
+   contexts and how many frames lie between it and the block, so it can
+   drop them and jump to the end */
+static void emit_local_block(struct assembler *as, lisp_object_t block_name, lisp_object_t body, struct lexical_context *ctxt, int tail)
+{
+    GC_PROTECT(body);
+    struct local_block block;
+    block.name = block_name;
+    GC_PROTECT(block.name);
+    block.depth = as->depth;
+    block.contexts = as->contexts;
+    block.scopes = lexical_context_scope_count(ctxt);
+    block.exits = NIL;
+    GC_PROTECT(block.exits);
+    block.next = ctxt->local_blocks;
+    ctxt->local_blocks = &block;
+    lisp_object_t entry = cons(block.name, T);
+    ctxt->block_alist = cons(entry, ctxt->block_alist);
+    emit_progn(as, body, ctxt, tail);
+    ctxt->block_alist = cdr(ctxt->block_alist);
+    ctxt->local_blocks = block.next;
+    for (; block.exits != NIL; block.exits = cdr(block.exits))
+        patch_u16(as, car(block.exits) >> 4, as->length);
+}
+
+/* Only a block that a closure returns from needs a context; one that is
+   never returned from needs nothing at all */
+static void emit_block(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt, int tail)
+{
+    GC_PROTECT(expr);
+    int found = find_return_from(cddr(expr), cadr(expr), 0);
+    if (found == 0) {
+        emit_progn(as, cddr(expr), ctxt, tail);
+    } else if (!(found & RETURN_FROM_CLOSURE)) {
+        emit_local_block(as, cadr(expr), cddr(expr), ctxt, tail);
+    } else {
+        lisp_object_t block_number = lexical_context_enter_block(ctxt, cadr(expr));
+        emit_numbered_block(as, block_number, cddr(expr), ctxt, 0);
+        lexical_context_leave_block(ctxt, cadr(expr));
+    }
+}
+
+static void emit_call(struct assembler *as, lisp_object_t fn, lisp_object_t args, struct lexical_context *ctxt, int tail)
+{
+    GC_PROTECT(fn);
+    GC_PROTECT(args);
+    struct primitive *primitive = find_primitive(fn);
+    if (primitive && consp(args) != NIL && consp(cdr(args)) != NIL && cddr(args) == NIL) {
+        emit_form(as, car(args), ctxt, 0);
+        emit_form(as, cadr(args), ctxt, 0);
+        int fixnums = fixnum_form_p(car(args), ctxt, NIL) && fixnum_form_p(cadr(args), ctxt, NIL);
+        emit_op(as, fixnums ? primitive->fixnum_op : primitive->op, -1);
+        return;
+    }
+    int nargs = 0;
+    for (; args != NIL; args = cdr(args), nargs++)
+        emit_form(as, car(args), ctxt, 0);
+    if (nargs > 0xff)
+        raise(sym("bytecode-limit-exceeded"), nargs << 4);
+    emit_op(as, tail ? OP_TAILCALL : OP_CALL, 1 - nargs);
+    emit_constant_operand(as, fn);
+    emit_byte(as, nargs);
+}
+
+static void emit_local_return_from(struct assembler *as, lisp_object_t block_name, lisp_object_t value, struct lexical_context *ctxt)
+{
+    struct local_block *block = ctxt->local_blocks;
+    while (block->name != block_name)
+        block = block->next;
+    int depth = as->depth;
+    emit_form(as, value, ctxt, 0);
+    int contexts = as->contexts - block->contexts;
+    int drop = as->depth - 1 - block->depth;
+    int frames = lexical_context_scope_count(ctxt) - block->scopes;
+    if (contexts > 0xff || drop > 0xffff || frames > 0xff)
+        raise(sym("bytecode-limit-exceeded"), drop << 4);
+    if (contexts > 0 || drop > 0 || frames > 0) {
+        emit_op(as, OP_UNWIND, -drop);
+        emit_byte(as, contexts);
+        emit_u16(as, drop);
+        emit_byte(as, frames);
+    }
+    emit_op(as, OP_JUMP, 0);
+    block->exits = cons(as->length << 4, block->exits);
+    emit_u16(as, 0);
+    /* What follows is unreachable, but is compiled as though the
+       return-from had left a value */
+    as->depth = depth + 1;
+}
+
+static void emit_return_from(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt)
+{
+    lisp_object_t x = assoc(cadr(expr), ctxt->block_alist);
+    if (x == NIL)
+        raise_condition("return-for-unknown-block", cadr(expr));
+    if (cdr(x) == T) {
+        emit_local_return_from(as, cadr(expr), caddr(expr), ctxt);
+        return;
+    }
+    GC_PROTECT(expr);
+    emit_constant(as, cdr(x));
+    emit_form(as, caddr(expr), ctxt, 0);
+    emit_op(as, OP_CALL, -1);
+    emit_constant_operand(as, interp->syms.raise);
+    emit_byte(as, 2);
+}
+
+/* A go in the body of the tagbody is a jump to an offset that is known
+   at compile time.  Only a tagbody that a closure can go to needs a
+   context at run time, for evalgo() to find */
+static void emit_tagbody(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt)
+{
+    GC_PROTECT(expr);
+    struct local_tagbody tagbody;
+    tagbody.tags = NIL;
+    GC_PROTECT(tagbody.tags);
+    lisp_object_t x = cdr(expr);
+    GC_PROTECT(x);
+    for (; x != NIL; x = cdr(x)) {
+        if (symbolp(car(x)) != NIL) {
+            lisp_object_t jumps = cons(NIL, NIL);
+            lisp_object_t tag = cons(car(x), jumps);
+            tagbody.tags = cons(tag, tagbody.tags);
+        }
+    }
+    int escapes = find_go_in_closure(cdr(expr), tagbody.tags, 0);
+    /* The tags are filled in with their offsets as they are reached */
+    lisp_object_t offsets = NIL;
+    GC_PROTECT(offsets);
+    if (escapes) {
+        for (x = tagbody.tags; x != NIL; x = cdr(x)) {
+            lisp_object_t offset = cons(caar(x), 0);
+            offsets = cons(offset, offsets);
+        }
+        emit_op(as, OP_TAGBODY, 1);
+        emit_constant_operand(as, offsets);
+        as->contexts++;
+    }
+    tagbody.depth = as->depth;
+    tagbody.contexts = as->contexts;
+    tagbody.scopes = lexical_context_scope_count(ctxt);
+    tagbody.next = ctxt->local_tagbodies;
+    ctxt->local_tagbodies = &tagbody;
+    for (x = cdr(expr); x != NIL; x = cdr(x)) {
+        if (symbolp(car(x)) != NIL) {
+            lisp_object_t tag = cdr(assoc(car(x), tagbody.tags));
+            rplaca(tag, as->length << 4);
+            for (lisp_object_t jumps = cdr(tag); jumps != NIL; jumps = cdr(jumps))
+                patch_u16(as, car(jumps) >> 4, as->length);
+            rplacd(tag, NIL);
+            if (escapes)
+                rplacd(assoc(car(x), offsets), as->length << 4);
+        } else {
+            emit_form(as, car(x), ctxt, 0);
+            emit_op(as, OP_POP, -1);
+        }
+    }
+    ctxt->local_tagbodies = tagbody.next;
+    emit_op(as, OP_NIL, 1);
+    if (escapes) {
+        as->contexts--;
+        emit_op(as, OP_POP_CONTEXTS, -1);
+        emit_byte(as, 1);
+    }
+}
+
+static void emit_go(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt)
+{
+    GC_PROTECT(expr);
+    lisp_object_t tag = NIL;
+    GC_PROTECT(tag);
+    struct local_tagbody *tagbody = ctxt->local_tagbodies;
+    for (; tagbody; tagbody = tagbody->next)
+        if ((tag = assoc(cadr(expr), tagbody->tags)) != NIL)
+            break;
+    if (!tagbody) {
+        emit_op(as, OP_GO, 1);
+        emit_constant_operand(as, cadr(expr));
+        return;
+    }
+    tag = cdr(tag);
+    int depth = as->depth;
+    int contexts = as->contexts - tagbody->contexts;
+    int drop = depth - tagbody->depth;
+    int frames = lexical_context_scope_count(ctxt) - tagbody->scopes;
+    if (contexts > 0xff || drop > 0xffff || frames > 0xff)
+        raise(sym("bytecode-limit-exceeded"), drop << 4);
+    if (contexts > 0 || drop > 0 || frames > 0) {
+        /* OP_UNWIND keeps the value on top, so give it one to keep */
+        emit_op(as, OP_NIL, 1);
+        emit_op(as, OP_UNWIND, -drop);
+        emit_byte(as, contexts);
+        emit_u16(as, drop);
+        emit_byte(as, frames);
+        emit_op(as, OP_POP, -1);
+    }
+    emit_op(as, OP_JUMP, 0);
+    if (car(tag) != NIL) {
+        emit_u16(as, car(tag) >> 4);
+    } else {
+        lisp_object_t jumps = cons(as->length << 4, cdr(tag));
+        rplacd(tag, jumps);
+        emit_u16(as, 0);
+    }
+    /* As for return-from, what follows is unreachable */
+    as->depth = depth + 1;
+}
+
+static void emit_condition_case(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt, int tail)
+{
+    GC_PROTECT(expr);
+    lisp_object_t clauses = cdr(cddr(expr));
+    GC_PROTECT(clauses);
+    /* Maps each symbol to the index of its handler; assoc finds the
+       first clause for a symbol, as in the tree-walker */
+    lisp_object_t indexes = NIL;
+    GC_PROTECT(indexes);
+    int count = 0;
+    for (; clauses != NIL; clauses = cdr(clauses), count++) {
+        lisp_object_t index = cons(caar(clauses), count << 4);
+        indexes = cons(index, indexes);
+    }
+    if (count > 0xff)
+        raise(sym("bytecode-limit-exceeded"), count << 4);
+    lisp_object_t ordered_indexes = NIL;
+    GC_PROTECT(ordered_indexes);
+    for (; indexes != NIL; indexes = cdr(indexes))
+        ordered_indexes = cons(car(indexes), ordered_indexes);
+    emit_op(as, OP_CONDITION_CASE, 1);
+    emit_constant_operand(as, ordered_indexes);
+    emit_byte(as, count);
+    size_t handlers = as->length;
+    for (int i = 0; i < count; i++)
+        emit_u16(as, 0);
+    int depth = as->depth;
+    as->contexts++;
+    emit_form(as, caddr(expr), ctxt, 0);
+    as->contexts--;
+    emit_op(as, OP_POP_CONTEXTS, -1);
+    emit_byte(as, 1);
+    /* Each handler starts with the condition in place of the saved
+       environment, and binds it to the variable */
+    lisp_object_t end_jumps = NIL;
+    GC_PROTECT(end_jumps);
+    lisp_object_t vars = cons(cadr(expr), NIL);
+    GC_PROTECT(vars);
+    clauses = cdr(cddr(expr));
+    for (int i = 0; i < count; i++, clauses = cdr(clauses)) {
+        emit_op(as, OP_JUMP, 0);
+        end_jumps = cons(as->length << 4, end_jumps);
+        emit_u16(as, 0);
+        patch_u16(as, handlers + 2 * i, as->length);
+        as->depth = depth;
+        emit_op(as, OP_LET, 0);
+        emit_byte(as, 1);
+        lexical_context_enter_scope(ctxt, vars, NIL);
+        emit_form(as, cadar(clauses), ctxt, tail);
+        lexical_context_leave_scope(ctxt);
+        emit_op(as, OP_UNLET, -1);
+    }
+    for (; end_jumps != NIL; end_jumps = cdr(end_jumps))
+        patch_u16(as, car(end_jumps) >> 4, as->length);
+}
+
+static lisp_object_t compile_lambda(lisp_object_t lambda_list, lisp_object_t body, struct lexical_context *ctxt);
+
+static void emit_function(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt)
+{
+    lisp_object_t function = cadr(expr);
+    GC_PROTECT(function);
+    if (symbolp(function) != NIL) {
+        emit_op(as, OP_FUNCTION, 1);
+        emit_constant_operand(as, function);
+    } else {
+        lisp_object_t code = compile_lambda(cadr(function), cddr(function), ctxt);
+        GC_PROTECT(code);
+        emit_op(as, OP_CLOSURE, 1);
+        emit_constant_operand(as, code);
+    }
+}
+
+static void emit_frame_address(struct assembler *as, int depth, int slot)
+{
+    if (depth > 0xff || slot > 0xff)
+        raise(sym("bytecode-limit-exceeded"), slot << 4);
+    emit_byte(as, depth);
+    emit_byte(as, slot);
+}
+
+static void emit_variable_ref(struct assembler *as, lisp_object_t var, struct lexical_context *ctxt)
+{
+    GC_PROTECT(var);
+    int depth, slot;
+    if (lexical_context_lookup(ctxt, var, &depth, &slot)) {
+        emit_op(as, OP_LOCALREF, 1);
+        emit_frame_address(as, depth, slot);
+    } else {
+        emit_op(as, OP_GLOBALREF, 1);
+        emit_constant_operand(as, var);
+    }
+}
+
+/* set with a quoted symbol (i.e. setq) can be resolved at compile time;
+   anything else can only assign a global */
+static void emit_set(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt)
+{
+    GC_PROTECT(expr);
+    lisp_object_t place = cadr(expr);
+    if (consp(place) != NIL && car(place) == interp->syms.quote && symbolp(cadr(place)) != NIL) {
+        lisp_object_t var = cadr(place);
+        GC_PROTECT(var);
+        int depth, slot;
+        emit_form(as, caddr(expr), ctxt, 0);
+        if (lexical_context_lookup(ctxt, var, &depth, &slot)) {
+            if (lexical_context_fixnum_p(ctxt, var) && !fixnum_form_p(caddr(expr), ctxt, NIL))
+                emit_op(as, OP_CHECK_FIXNUM, 0);
+            emit_op(as, OP_LOCALSET, 0);
+            emit_frame_address(as, depth, slot);
+        } else {
+            emit_op(as, OP_GLOBALSET, 0);
+            emit_constant_operand(as, var);
+        }
+    } else {
+        emit_form(as, cadr(expr), ctxt, 0);
+        emit_form(as, caddr(expr), ctxt, 0);
+        emit_op(as, OP_SET, -1);
+    }
+}
+
+static void emit_form(struct assembler *as, lisp_object_t expr, struct lexical_context *ctxt, int tail)
+{
+    GC_PROTECT(expr);
+    if (atom(expr) != NIL) {
+        if (symbolp(expr) != NIL && expr != NIL && expr != T) {
+            emit_variable_ref(as, expr, ctxt);
+        } else {
+            emit_constant(as, expr);
+        }
+    } else if (symbolp(car(expr)) != NIL) {
+        switch (SymbolSpecialForm(car(expr))) {
+        case SPECIAL_FORM_BLOCK:
+            emit_block(as, expr, ctxt, tail);
+            break;
+        case SPECIAL_FORM_PCTBLOCK:
+            emit_numbered_block(as, cadr(expr), cddr(expr), ctxt, 0);
+            break;
+        case SPECIAL_FORM_RETURN_FROM:
+            emit_return_from(as, expr, ctxt);
+            break;
+        case SPECIAL_FORM_QUOTE:
+            emit_constant(as, cadr(expr));
+            break;
+        case SPECIAL_FORM_QUASIQUOTE:
+            emit_form(as, expand_quasiquote(cadr(expr), 0), ctxt, tail);
+            break;
+        case SPECIAL_FORM_UNQUOTE:
+            raise_condition("runtime-error", sym("comma-not-inside-backquote"));
+            break;
+        case SPECIAL_FORM_IF:
+            emit_if(as, expr, ctxt, tail);
+            break;
+        case SPECIAL_FORM_LET:
+            emit_let(as, expr, ctxt, tail);
+            break;
+        case SPECIAL_FORM_SET:
+            emit_set(as, expr, ctxt);
+            break;
+        case SPECIAL_FORM_PROGN:
+            emit_progn(as, cdr(expr), ctxt, tail);
+            break;
+        case SPECIAL_FORM_TAGBODY:
+            emit_tagbody(as, expr, ctxt);
+            break;
+        case SPECIAL_FORM_GO:
+            emit_go(as, expr, ctxt);
+            break;
+        case SPECIAL_FORM_CONDITION_CASE:
+            emit_condition_case(as, expr, ctxt, tail);
+            break;
+        case SPECIAL_FORM_FUNCTION:
+            emit_function(as, expr, ctxt);
+            break;
+        case SPECIAL_FORM_DECLARE:
+            emit_op(as, OP_NIL, 1);
+            break;
+        default:
+            emit_call(as, car(expr), cdr(expr), ctxt, tail);
+            break;
+        }
+    } else {
+        raise_condition("bad-expression", expr);
+    }
+}
+
+static lisp_object_t compile_lambda(lisp_object_t lambda_list, lisp_object_t body, struct lexical_context *ctxt)
+{
+    GC_PROTECT(lambda_list);
+    GC_PROTECT(body);
+    struct assembler as;
+    assembler_init(&as);
+    GC_PROTECT_ASSEMBLER(as);
+    /* The function can only leave its caller's blocks and tagbodies
+       through their contexts */
+    struct local_block *local_blocks = ctxt->local_blocks;
+    struct local_tagbody *local_tagbodies = ctxt->local_tagbodies;
+    ctxt->local_blocks = NULL;
+    ctxt->local_tagbodies = NULL;
+    lisp_object_t parsed_lambda_list = parse_lambda_list(lambda_list);
+    GC_PROTECT(parsed_lambda_list);
+    /* The VM only makes a frame for a function that takes arguments */
+    if (cdr(parsed_lambda_list) != NIL) {
+        lisp_object_t declared = declared_fixnums(body);
+        GC_PROTECT(declared);
+        lisp_object_t fixnums = NIL;
+        GC_PROTECT(fixnums);
+        int slot = FRAME_FIRST_SLOT;
+        lisp_object_t x = cdr(parsed_lambda_list);
+        GC_PROTECT(x);
+        for (; x != NIL; x = cdr(x), slot++) {
+            if (!memberp(car(x), declared))
+                continue;
+            emit_op(&as, OP_LOCALREF, 1);
+            emit_frame_address(&as, 0, slot);
+            emit_op(&as, OP_CHECK_FIXNUM, 0);
+            emit_op(&as, OP_POP, -1);
+            fixnums = cons(car(x), fixnums);
+        }
+        lexical_context_enter_scope(ctxt, cdr(parsed_lambda_list), fixnums);
+    }
+    emit_progn(&as, body, ctxt, 1);
+    if (cdr(parsed_lambda_list) != NIL)
+        lexical_context_leave_scope(ctxt);
+    ctxt->local_blocks = local_blocks;
+    ctxt->local_tagbodies = local_tagbodies;
+    emit_op(&as, OP_RETURN, -1);
+    return assemble(&as, parsed_lambda_list);
+}
+
+/* Returns a function of no arguments that evaluates expr, or nil if it
+   is too big to be compiled to bytecode.  The optimizer expands every
+   macro in expr as it goes, so the emitter, and the analyses of blocks
+   and tagbodies it makes before emitting their bodies, only ever see
+   expanded code. */
+lisp_object_t compile_bytecode(lisp_object_t expr)
+{
+    GC_PROTECT(expr);
+    struct lexical_context ctxt;
+    lexical_context_init(&ctxt);
+    GC_PROTECT_LEXICAL_CONTEXT(ctxt);
+    push_return_context(sym("bytecode-limit-exceeded"));
+    if (__builtin_setjmp(interp->return_stack->buf)) {
+        pop_return_context();
+        return NIL;
+    }
+    lisp_object_t body = optimize_toplevel(expr);
+    body = cons(body, NIL);
+    lisp_object_t code = compile_lambda(NIL, body, &ctxt);
+    pop_return_context();
+    return make_compiled_function(code, NIL);
+}
@@ -12,12 +12,14 @@
 
 (defmacro defparameter (name initial-value)
   `(progn
-     (putprop ',name 'param t)
+     (proclaim-special ',name)
      (set-symbol-value ',name ,initial-value)
      ',name))
 
-(defun list (&rest args)
-  args)
+(defmacro defconstant (name value)
+  `(progn
+     (proclaim-constant ',name ,value)
+     ',name))
 
 (defmacro cond (&rest clauses)
   (let ((first-clause (car clauses)))
@@ -134,12 +136,17 @@
       (if (two-arg-less-than first (car rest))
 	  (apply '< rest))))
 
+(putprop '+ 'two-arg-function 'two-arg-plus)
+(putprop '- 'two-arg-function 'two-arg-minus)
+(putprop '* 'two-arg-function 'two-arg-times)
+(putprop '< 'two-arg-function 'two-arg-less-than)
+(putprop '> 'two-arg-function 'two-arg-greater-than)
+
 (defmacro dotimes (var-and-max &body thing)
   (let ((var (car var-and-max))
 	  (max (car (cdr var-and-max))))
-      `(let ((,var nil))
+      `(let ((,var 0))
 	 (tagbody
-	    (setq ,var 0)
 	  iterate
 	    ,@thing
 	    (setq ,var (+ 1 ,var))
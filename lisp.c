@@ -1,11 +1,11 @@
 #include "lisp.h"
 #include "string_buffer.h"
 #include "text_stream.h"
+#include "vm.h"
 
 #include <alloca.h>
 #include <assert.h>
 #include <fcntl.h>
-#include <setjmp.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,19 +13,13 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 struct lisp_interpreter *interp;
 
 static int interpreter_initialized;
 
-struct vector {
-    object_header_t header;
-    size_t len;
-    size_t size_bytes;
-    uint64_t padding;
-};
-
 lisp_object_t istype(lisp_object_t obj, uint64_t type);
 
 static void check_type(lisp_object_t obj, uint64_t type)
@@ -35,7 +29,7 @@ static void check_type(lisp_object_t obj, uint64_t type)
         static char buf[1024];
         char *obj_string = print_object(obj);
         int len = snprintf(buf, 1024, "Not a %s: %s", type_names[type >> 1], obj_string);
-        raise(sym("type-error"), allocate_string(len + 1, buf));
+        raise_condition("type-error", allocate_string(len + 1, buf));
     }
 }
 
@@ -85,6 +79,7 @@ lisp_object_t rplaca(lisp_object_t the_cons, lisp_object_t the_car)
     check_cons(the_cons);
     struct cons *p = ConsPtr(the_cons);
     p->car = the_car;
+    write_barrier(&p->car, the_car);
     return the_cons;
 }
 
@@ -93,6 +88,7 @@ lisp_object_t rplacd(lisp_object_t the_cons, lisp_object_t the_cdr)
     check_cons(the_cons);
     struct cons *p = ConsPtr(the_cons);
     p->cdr = the_cdr;
+    write_barrier(&p->cdr, the_cdr);
     return the_cons;
 }
 
@@ -123,8 +119,13 @@ lisp_object_t functionp(lisp_object_t obj)
 
 void check_integer(int64_t obj)
 {
-    if (obj % 16)
-        abort();
+    if (integerp(obj) == NIL) {
+        static char buf[1024];
+        char *obj_string = print_object(obj);
+        int len = snprintf(buf, 1024, "Not an integer: %s", obj_string);
+        free(obj_string);
+        raise_condition("type-error", allocate_string(len + 1, buf));
+    }
 }
 
 lisp_object_t integerp(lisp_object_t obj)
@@ -171,20 +172,17 @@ lisp_object_t svref_set(lisp_object_t vector, lisp_object_t index, lisp_object_t
 {
     lisp_object_t *storage = check_vector_bounds_get_storage(vector, index);
     storage[index >> 4] = newvalue;
+    write_barrier(&storage[index >> 4], newvalue);
     return newvalue;
 }
 
-static void gc_if_needed(size_t);
-
-static lisp_object_t allocate_function();
+static char *allocate_bytes(size_t);
 
 lisp_object_t allocate_vector(lisp_object_t size)
 {
     size >>= 4;
     size_t bytes_to_allocate = sizeof(struct vector) + (size + size % 2) * sizeof(lisp_object_t);
-    gc_if_needed(bytes_to_allocate);
-    struct vector *v = (struct vector *)interp->heap.freeptr;
-    interp->heap.freeptr += bytes_to_allocate;
+    struct vector *v = (struct vector *)allocate_bytes(bytes_to_allocate);
     v->header = VECTOR_TYPE;
     v->len = size << 4;
     v->size_bytes = bytes_to_allocate;
@@ -195,15 +193,22 @@ lisp_object_t allocate_vector(lisp_object_t size)
     return result;
 }
 
-static void define_built_in_function(char *symbol_name, void (*function_pointer)(void), int arity)
+lisp_object_t define_native_function(char *symbol_name, void (*function_pointer)(void), int arity, int flags)
 {
-    struct symbol *symptr = SymbolPtr(sym(symbol_name));
-    lisp_object_t fp = (((uint64_t)function_pointer) << 4) | FUNCTION_POINTER_TYPE;
+    assert(arity <= NATIVE_MAX_ARITY || (flags & NATIVE_VARIADIC));
+    lisp_object_t symbol = sym(symbol_name);
+    GC_PROTECT(symbol);
     lisp_object_t fn = allocate_function();
-    struct lisp_function *fnptr = LispFunctionPtr(fn);
-    fnptr->kind = interp->syms.built_in_function;
-    fnptr->actual_function = cons(interp->syms.built_in_function, cons(fp, cons(((uint64_t)arity) << 4, NIL)));
-    symptr->function = fn;
+    struct native_function *native = NativeFunctionPtr(fn);
+    native->kind = interp->syms.built_in_function;
+    native->entry = (((uint64_t)function_pointer) << 4) | FUNCTION_POINTER_TYPE;
+    native->name = symbol;
+    native->arity = ((uint64_t)arity) << 4;
+    native->flags = flags;
+    SymbolPtr(symbol)->function = fn;
+    write_barrier(&SymbolPtr(symbol)->function, fn);
+    interp->function_epoch++;
+    return fn;
 }
 
 void do_read(int fd, char *dest, size_t len)
@@ -238,6 +243,7 @@ static void init_symbols()
     interp->syms.unquote_splice = sym("unquote-splice");
     interp->syms.let = sym("let");
     interp->syms.integer = sym("integer");
+    interp->syms.fixnum = sym("fixnum");
     interp->syms.symbol = sym("symbol");
     interp->syms.cons = sym("cons");
     interp->syms.string = sym("string");
@@ -246,8 +252,36 @@ static void init_symbols()
     interp->syms.function = sym("function");
     interp->syms.block = sym("block");
     interp->syms.pctblock = sym("%block");
+    interp->syms.pcttagbody = sym("%tagbody");
     interp->syms.return_from = sym("return-from");
     interp->syms.if_ = sym("if");
+    interp->syms.compiled_function = sym("compiled-function");
+    interp->syms.declare = sym("declare");
+    interp->syms.list = sym("list");
+    interp->syms.append = sym("append");
+    interp->syms.raise = sym("raise");
+    interp->syms.inline_expansion = sym("inline-expansion");
+    interp->syms.inline_callers = sym("inline-callers");
+    interp->syms.inline_source = sym("inline-source");
+    interp->syms.inline_function = sym("inline-function");
+    interp->syms.two_arg_function = sym("two-arg-function");
+    interp->syms.define_function = sym("%define-function");
+    SymbolSpecialForm(interp->syms.quote) = SPECIAL_FORM_QUOTE;
+    SymbolSpecialForm(interp->syms.quasiquote) = SPECIAL_FORM_QUASIQUOTE;
+    SymbolSpecialForm(interp->syms.unquote) = SPECIAL_FORM_UNQUOTE;
+    SymbolSpecialForm(interp->syms.if_) = SPECIAL_FORM_IF;
+    SymbolSpecialForm(interp->syms.let) = SPECIAL_FORM_LET;
+    SymbolSpecialForm(interp->syms.set) = SPECIAL_FORM_SET;
+    SymbolSpecialForm(interp->syms.progn) = SPECIAL_FORM_PROGN;
+    SymbolSpecialForm(interp->syms.block) = SPECIAL_FORM_BLOCK;
+    SymbolSpecialForm(interp->syms.pctblock) = SPECIAL_FORM_PCTBLOCK;
+    SymbolSpecialForm(interp->syms.return_from) = SPECIAL_FORM_RETURN_FROM;
+    SymbolSpecialForm(interp->syms.tagbody) = SPECIAL_FORM_TAGBODY;
+    SymbolSpecialForm(interp->syms.pcttagbody) = SPECIAL_FORM_PCTTAGBODY;
+    SymbolSpecialForm(interp->syms.go) = SPECIAL_FORM_GO;
+    SymbolSpecialForm(interp->syms.condition_case) = SPECIAL_FORM_CONDITION_CASE;
+    SymbolSpecialForm(interp->syms.function) = SPECIAL_FORM_FUNCTION;
+    SymbolSpecialForm(interp->syms.declare) = SPECIAL_FORM_DECLARE;
 }
 
 lisp_object_t length(lisp_object_t seq);
@@ -281,29 +315,61 @@ lisp_object_t quit()
     exit(0);
 }
 
-lisp_object_t funcall(lisp_object_t fn, lisp_object_t x, lisp_object_t a)
+lisp_object_t funcall(int nargs, lisp_object_t *args, lisp_object_t a)
 {
-    return apply(fn, x, a);
+    GC_PROTECT(a);
+    lisp_object_t x = NIL;
+    for (int i = nargs - 1; i > 0; i--)
+        x = cons(args[i], x);
+    return apply(args[0], x, a);
 }
 
-lisp_object_t gc();
+lisp_object_t lisp_list(int nargs, lisp_object_t *args, lisp_object_t a)
+{
+    lisp_object_t result = NIL;
+    for (int i = nargs - 1; i >= 0; i--)
+        result = cons(args[i], result);
+    return result;
+}
+
+/* Copies all but the last list, which the result shares */
+lisp_object_t lisp_append(int nargs, lisp_object_t *args, lisp_object_t a)
+{
+    if (nargs == 0)
+        return NIL;
+    lisp_object_t result = args[nargs - 1];
+    GC_PROTECT(result);
+    for (int i = nargs - 2; i >= 0; i--) {
+        lisp_object_t reversed = NIL;
+        GC_PROTECT(reversed);
+        lisp_object_t x = args[i];
+        GC_PROTECT(x);
+        for (; x != NIL; x = cdr(x))
+            reversed = cons(car(x), reversed);
+        for (; reversed != NIL; reversed = cdr(reversed))
+            result = cons(car(reversed), result);
+    }
+    return result;
+}
 
 lisp_object_t set_symbol_function(lisp_object_t symbol, lisp_object_t function);
 
+lisp_object_t define_function(lisp_object_t symbol, lisp_object_t function, lisp_object_t expansion, lisp_object_t inlined, lisp_object_t definition);
+
 lisp_object_t set_symbol_value(lisp_object_t symbol, lisp_object_t value);
 
 lisp_object_t symbol_value(lisp_object_t symbol);
 
-#define FUNCALL_ARITY -1
-
 static void init_builtins()
 {
-#define DEFBUILTIN(S, F, A) define_built_in_function(S, (void (*)())F, A)
-    DEFBUILTIN("car", car, 1);
-    DEFBUILTIN("cdr", cdr, 1);
+#define DEFBUILTIN(S, F, A) define_native_function(S, (void (*)())F, A, 0)
+#define DEFBUILTIN_VARIADIC(S, F, A) define_native_function(S, (void (*)())F, A, NATIVE_VARIADIC)
+#define DEFBUILTIN_PURE(S, F, A) define_native_function(S, (void (*)())F, A, NATIVE_PURE)
+    DEFBUILTIN_PURE("car", car, 1);
+    DEFBUILTIN_PURE("cdr", cdr, 1);
     DEFBUILTIN("cons", cons, 2);
-    DEFBUILTIN("atom", atom, 1);
-    DEFBUILTIN("eq", eq, 2);
+    DEFBUILTIN_PURE("atom", atom, 1);
+    DEFBUILTIN_PURE("eq", eq, 2);
     DEFBUILTIN("load", load, 1);
     DEFBUILTIN("read", lisp_read, 0);
     DEFBUILTIN("print", print, 1);
@@ -311,11 +377,11 @@ static void init_builtins()
     DEFBUILTIN("eval", eval_toplevel, 1);
     DEFBUILTIN("rplaca", rplaca, 2);
     DEFBUILTIN("rplacd", rplacd, 2);
-    DEFBUILTIN("two-arg-plus", plus, 2);
-    DEFBUILTIN("two-arg-minus", minus, 2);
-    DEFBUILTIN("two-arg-times", times, 2);
+    DEFBUILTIN_PURE("two-arg-plus", plus, 2);
+    DEFBUILTIN_PURE("two-arg-minus", minus, 2);
+    DEFBUILTIN_PURE("two-arg-times", times, 2);
     DEFBUILTIN("two-arg-divide", divide, 2);
-    DEFBUILTIN("=", eq, 2);
+    DEFBUILTIN_PURE("=", eq, 2);
     DEFBUILTIN("raise", raise, 2);
     DEFBUILTIN("exit", exit, 1);
     DEFBUILTIN("get", getprop, 2);
@@ -324,27 +390,53 @@ static void init_builtins()
     DEFBUILTIN("svref", svref, 2);
     DEFBUILTIN("set-svref", svref_set, 3);
     DEFBUILTIN("save-image", save_image, 1);
-    DEFBUILTIN("type-of", type_of, 1);
-    DEFBUILTIN("integerp", integerp, 1);
-    DEFBUILTIN("consp", consp, 1);
-    DEFBUILTIN("stringp", stringp, 1);
-    DEFBUILTIN("vectorp", vectorp, 1);
-    DEFBUILTIN("functionp", functionp, 1);
-    DEFBUILTIN("string-equal-p", string_equalp, 2);
-    DEFBUILTIN("length", length, 1);
-    DEFBUILTIN("two-arg-greater-than", greater_than, 2);
-    DEFBUILTIN("two-arg-less-than", less_than, 2);
+    DEFBUILTIN_PURE("type-of", type_of, 1);
+    DEFBUILTIN_PURE("integerp", integerp, 1);
+    DEFBUILTIN_PURE("consp", consp, 1);
+    DEFBUILTIN_PURE("stringp", stringp, 1);
+    DEFBUILTIN_PURE("vectorp", vectorp, 1);
+    DEFBUILTIN_PURE("functionp", functionp, 1);
+    DEFBUILTIN_PURE("string-equal-p", string_equalp, 2);
+    DEFBUILTIN_PURE("length", length, 1);
+    DEFBUILTIN_PURE("two-arg-greater-than", greater_than, 2);
+    DEFBUILTIN_PURE("two-arg-less-than", less_than, 2);
     DEFBUILTIN("apply", do_apply, 2);
     DEFBUILTIN("quit", quit, 0);
-    DEFBUILTIN("funcall", funcall, FUNCALL_ARITY);
+    DEFBUILTIN_VARIADIC("funcall", funcall, 1);
+    DEFBUILTIN_VARIADIC("list", lisp_list, 0);
+    DEFBUILTIN_VARIADIC("append", lisp_append, 0);
     DEFBUILTIN("gc", gc, 0);
+    DEFBUILTIN("gc-stats", gc_statistics, 0);
     DEFBUILTIN("gensym", gensym, 0);
+    DEFBUILTIN("make-symbol", make_symbol, 1);
     DEFBUILTIN("set-symbol-function", set_symbol_function, 2);
+    DEFBUILTIN("%define-function", define_function, 5);
     DEFBUILTIN("set-symbol-value", set_symbol_value, 2);
     DEFBUILTIN("symbol-value", symbol_value, 1);
+    DEFBUILTIN("proclaim-special", proclaim_special, 1);
+    DEFBUILTIN("proclaim-constant", proclaim_constant, 2);
 #undef DEFBUILTIN
+#undef DEFBUILTIN_VARIADIC
+#undef DEFBUILTIN_PURE
 }
 
+/* Conses in an image may have ids from an earlier run, so an entry
+ * is only used when its form is the very same cons */
+static void init_macro_cache()
+{
+    interp->macro_cache = malloc(MACRO_CACHE_SIZE * sizeof(struct macro_cache_entry));
+    for (int i = 0; i < MACRO_CACHE_SIZE; i++) {
+        interp->macro_cache[i].form = NIL;
+        interp->macro_cache[i].expansion = NIL;
+        interp->macro_cache[i].function_epoch = 0;
+    }
+    interp->next_cons_id = 1;
+}
+
+static void init_heap_tables(struct lisp_heap *heap);
+static char *reserve_heap();
+static void commit_heap(struct lisp_heap *heap);
+
 void init_interpeter_from_image(char *image)
 {
     assert(!interpreter_initialized);
@@ -355,152 +447,450 @@ void init_interpeter_from_image(char *image)
     }
     interp = (struct lisp_interpreter *)malloc(sizeof(struct lisp_interpreter));
     assert(sizeof(lisp_object_t) == sizeof(void *));
+    interp->return_contexts = malloc(RETURN_STACK_SIZE * sizeof(struct return_context));
     interp->return_stack = NULL;
-    interp->top_of_stack = get_rbp(2);
+    interp->shadow_stack = malloc(SHADOW_STACK_SIZE * sizeof(lisp_object_t *));
+    interp->shadow_sp = 0;
+    interp->vm_stack = malloc(VM_STACK_SIZE * sizeof(lisp_object_t));
+    interp->vm_sp = 0;
+    interp->gc_log = NULL;
+    init_macro_cache();
     do_read(fd, (char *)&interp->symbol_table, sizeof(lisp_object_t));
     do_read(fd, (char *)&interp->heap, sizeof(struct lisp_heap));
-    void *rc = mmap(interp->heap.heap, interp->heap.size_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
-    if (rc == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
+    /* The call caches in the image are only good for epochs after this */
+    do_read(fd, (char *)&interp->function_epoch, sizeof(size_t));
+    char *rc = reserve_heap();
     assert(rc == interp->heap.heap);
-    do_read(fd, interp->heap.heap, interp->heap.size_bytes);
+    commit_heap(&interp->heap);
+    /* Only from-space is kept in the image */
+    do_read(fd, interp->heap.from_space, interp->heap.size_bytes / 2);
+    init_heap_tables(&interp->heap);
+    /* Symbols are set up below without the write barrier */
+    interp->heap.pause_budget = 0;
+    memset(&interp->heap.stats, 0, sizeof(struct gc_stats));
     init_symbols();
     init_builtins();
     interpreter_initialized = 1;
 }
 
+/* The symbol table is an open-addressing hash table keyed by a hash of
+ * the symbol name.  It is a Lisp vector, so the collector moves it and
+ * updates its entries like those of any other vector, and as the hash
+ * does not depend on addresses nothing needs rehashing afterwards.  Slot
+ * 0 holds the number of symbols and the rest are symbols or nil. */
+#define SYMBOL_TABLE_COUNT 0
+#define SYMBOL_TABLE_FIRST_ENTRY 1
+#define SYMBOL_TABLE_INITIAL_CAPACITY 64 /* a power of two */
+
+static lisp_object_t make_symbol_table(size_t capacity);
+
 void init_interpreter(size_t heap_size)
 {
     assert(!interpreter_initialized);
     interp = (struct lisp_interpreter *)malloc(sizeof(struct lisp_interpreter));
     assert(sizeof(lisp_object_t) == sizeof(void *));
     interp->symbol_table = NIL;
+    interp->return_contexts = malloc(RETURN_STACK_SIZE * sizeof(struct return_context));
     interp->return_stack = NULL;
-    interp->top_of_stack = get_rbp(2);
+    interp->shadow_stack = malloc(SHADOW_STACK_SIZE * sizeof(lisp_object_t *));
+    interp->shadow_sp = 0;
+    interp->vm_stack = malloc(VM_STACK_SIZE * sizeof(lisp_object_t));
+    interp->vm_sp = 0;
+    interp->gc_log = NULL;
+    interp->function_epoch = 1;
+    init_macro_cache();
     lisp_heap_init(&interp->heap, heap_size);
+    interp->symbol_table = make_symbol_table(SYMBOL_TABLE_INITIAL_CAPACITY);
     init_symbols();
     init_builtins();
     interpreter_initialized = 1;
 }
 
+/* The nursery is an eighth of the size of the semispaces */
+#define NURSERY_FRACTION 8
+/* Objects bigger than a quarter of the nursery are allocated straight
+ * into from-space, rather than being copied out of the nursery */
+#define LARGE_OBJECT_FRACTION 4
+#define CARD_SIZE 256
+/* With a pause budget the nursery may shrink down to this */
+#define MIN_NURSERY_BYTES (16 * 1024)
+/* The collector looks at the clock during a slice of an incremental
+ * collection after this many slots' (or roots') worth of work */
+#define SLOTS_BETWEEN_CLOCK_CHECKS 256
+/* The least allocation between slices */
+#define MIN_STEP_INTERVAL 1024
+/* The default for heap->target_occupancy, in percent */
+#define TARGET_OCCUPANCY 50
+
+#define NURSERY_RESERVE (2 * LISP_SEMISPACE_RESERVE / NURSERY_FRACTION)
+
+static size_t objsize(lisp_object_t obj);
+
+/* An object's header holds its type and, once the object has been
+ * copied, the address of the copy.  Copying leaves the rest of the
+ * object alone, as the mutator goes on using it during an incremental
+ * collection. */
+#define HeaderType(p) (*(object_header_t *)(p) & TYPE_MASK)
+#define HeaderForwarding(p) (*(object_header_t *)(p) & PTR_MASK)
+
+static size_t object_size_at(char *p)
+{
+    return objsize((lisp_object_t)p | HeaderType(p));
+}
+
+static size_t card_table_size(struct lisp_heap *heap)
+{
+    return heap->size_bytes / 2 / CARD_SIZE + 1;
+}
+
+static size_t object_starts_size(struct lisp_heap *heap)
+{
+    return heap->size_bytes / 2 / 16 / 8 + 1;
+}
+
+/* object_starts has a bit for each 16 bytes of space */
+static void set_object_start(unsigned char *object_starts, char *space, char *p)
+{
+    size_t index = (p - space) / 16;
+    object_starts[index / 8] |= 1 << (index % 8);
+}
+
+/* The tables are not kept in an image, so they are rebuilt when one is loaded */
+static void init_heap_tables(struct lisp_heap *heap)
+{
+    heap->cards = calloc(card_table_size(heap), 1);
+    heap->mutated_cards = calloc(card_table_size(heap), 1);
+    heap->object_starts = calloc(object_starts_size(heap), 1);
+    heap->to_space_object_starts = calloc(object_starts_size(heap), 1);
+    for (char *p = heap->from_space; p < heap->old_freeptr; p += object_size_at(p))
+        set_object_start(heap->object_starts, heap->from_space, p);
+}
+
+static size_t round_up(size_t n, size_t multiple)
+{
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+/* Makes the first len bytes of a reserved region usable, and gives the
+ * rest back to the system */
+static void commit_region(char *start, size_t len, size_t reserve)
+{
+    len = round_up(len, sysconf(_SC_PAGESIZE));
+    if (len > 0 && mprotect(start, len, PROT_READ | PROT_WRITE) != 0) {
+        perror("commit_region: mprotect failed");
+        exit(1);
+    }
+    if (len < reserve && mmap(start + len, reserve - len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+        perror("commit_region: mmap failed");
+        exit(1);
+    }
+}
+
+/* Each semispace has LISP_SEMISPACE_RESERVE bytes of address space,
+ * and the nursery follows them, so the spaces stay where they are as
+ * the heap changes size */
+static void commit_heap(struct lisp_heap *heap)
+{
+    commit_region(heap->heap, heap->size_bytes / 2, LISP_SEMISPACE_RESERVE);
+    commit_region(heap->heap + LISP_SEMISPACE_RESERVE, heap->size_bytes / 2, LISP_SEMISPACE_RESERVE);
+    commit_region(heap->nursery, heap->nursery_bytes, NURSERY_RESERVE);
+}
+
+static char *reserve_heap()
+{
+    char *p = (char *)mmap((void *)LISP_HEAP_BASE, 2 * LISP_SEMISPACE_RESERVE + NURSERY_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    if (p == (char *)-1) {
+        perror("reserve_heap: mmap failed");
+        exit(1);
+    }
+    return p;
+}
+
 void lisp_heap_init(struct lisp_heap *heap, size_t bytes)
 {
     assert(bytes % 2 == 0);
     assert(bytes % sizeof(lisp_object_t) == 0);
-    heap->heap = (char *)mmap((void *)LISP_HEAP_BASE, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
-    if (heap->heap == (char *)-1) {
-        perror("lisp_heap_init: mmap failed");
-        exit(1);
-    }
-    heap->freeptr = heap->heap;
+    assert(bytes <= 2 * LISP_SEMISPACE_RESERVE);
+    heap->heap = reserve_heap();
     heap->size_bytes = bytes;
     heap->from_space = heap->heap;
-    heap->to_space = heap->heap + bytes / 2;
+    heap->to_space = heap->heap + LISP_SEMISPACE_RESERVE;
+    heap->nursery_bytes = (bytes / NURSERY_FRACTION) & ~(size_t)15;
+    heap->nursery = heap->heap + 2 * LISP_SEMISPACE_RESERVE;
+    commit_heap(heap);
+    heap->freeptr = heap->nursery;
+    heap->old_freeptr = heap->from_space;
+    heap->collecting = GC_FULL;
+    heap->pause_budget = 0;
+    heap->cycle_active = 0;
+    heap->nursery_target = heap->nursery_bytes;
+    heap->promoted_per_minor = 0;
+    heap->scanned_per_slice = 0;
+    heap->pause_depth = 0;
+    heap->min_bytes = bytes;
+    heap->max_bytes = 2 * LISP_SEMISPACE_RESERVE;
+    heap->target_occupancy = TARGET_OCCUPANCY;
+    memset(&heap->stats, 0, sizeof(struct gc_stats));
+    init_heap_tables(heap);
 }
 
 static void assert_heap_invariants(struct lisp_heap *heap)
 {
     assert(heap->freeptr >= heap->heap);
-    assert(heap->freeptr <= heap->heap + heap->size_bytes);
+    assert(heap->freeptr <= heap->nursery + heap->nursery_bytes);
+    assert(heap->old_freeptr >= heap->from_space && heap->old_freeptr <= heap->from_space + heap->size_bytes / 2);
     assert(heap->to_space == heap->heap || heap->from_space == heap->heap);
 }
 
 void lisp_heap_free(struct lisp_heap *heap)
 {
-    int rc = munmap(heap->heap, heap->size_bytes);
+    int rc = munmap(heap->heap, 2 * LISP_SEMISPACE_RESERVE + NURSERY_RESERVE);
     if (rc != 0) {
         perror("lisp_heap_free: munmap failed");
         exit(1);
     }
+    free(heap->cards);
+    free(heap->mutated_cards);
+    free(heap->object_starts);
+    free(heap->to_space_object_starts);
+}
+
+static size_t old_space_free(struct lisp_heap *heap)
+{
+    return heap->from_space + heap->size_bytes / 2 - heap->old_freeptr;
+}
+
+static size_t nursery_size(struct lisp_heap *heap)
+{
+    return heap->pause_budget ? heap->nursery_target : heap->nursery_bytes;
+}
+
+/* The nursery is never let hold more than from-space has room for, so
+ * that a minor collection can always promote everything in it, and a
+ * full one can always copy both into to-space */
+static char *nursery_limit(struct lisp_heap *heap)
+{
+    size_t room = old_space_free(heap);
+    return heap->nursery + (room < nursery_size(heap) ? room : nursery_size(heap));
+}
+
+static long monotonic_microseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* A pause may take several collections, as when a minor one is
+ * followed by a slice of an incremental one, and counts as one */
+static void gc_pause_begin(struct lisp_heap *heap)
+{
+    if (heap->pause_depth++ == 0)
+        heap->pause_start = monotonic_microseconds();
+}
+
+static void gc_pause_end(struct lisp_heap *heap)
+{
+    if (--heap->pause_depth)
+        return;
+    long pause = monotonic_microseconds() - heap->pause_start;
+    heap->stats.total_pause += pause;
+    if (pause > heap->stats.max_pause)
+        heap->stats.max_pause = pause;
+}
+
+/* Adds slots' worth of work to *work, which is null outside of the
+ * slices of incremental collections, and says whether the pause has
+ * used up its budget.  Looking at the clock is much slower than
+ * copying a slot, so it is only done every so often. */
+static int gc_budget_spent(struct lisp_heap *heap, size_t *work, size_t slots)
+{
+    if (!work)
+        return 0;
+    *work += slots;
+    if (*work < SLOTS_BETWEEN_CLOCK_CHECKS)
+        return 0;
+    *work = 0;
+    return monotonic_microseconds() - heap->pause_start >= heap->pause_budget;
+}
+
+static void heap_exhausted()
+{
+    printf("Heap exhausted\n");
+    exit(1);
+}
+
+static void heap_adapt(struct lisp_heap *heap, size_t bytes_needed);
+
+/* The last resort before giving up on an allocation */
+static void gc_for_room(struct lisp_heap *heap, size_t bytes_needed)
+{
+    gc();
+    heap_adapt(heap, bytes_needed);
+}
+
+/* A large object starts out with all its cards dirty, as it may be
+ * filled in without the write barrier just like a new object in the
+ * nursery */
+static char *allocate_large_object(struct lisp_heap *heap, size_t bytes_needed)
+{
+    if (old_space_free(heap) < bytes_needed + (heap->freeptr - heap->nursery))
+        gc_for_room(heap, bytes_needed);
+    if (old_space_free(heap) < bytes_needed)
+        heap_exhausted();
+    char *p = heap->old_freeptr;
+    heap->old_freeptr += bytes_needed;
+    set_object_start(heap->object_starts, heap->from_space, p);
+    size_t first_card = (p - heap->from_space) / CARD_SIZE;
+    size_t last_card = (heap->old_freeptr - 1 - heap->from_space) / CARD_SIZE;
+    memset(heap->cards + first_card, 1, last_card - first_card + 1);
+    if (heap->cycle_active)
+        memset(heap->mutated_cards + first_card, 1, last_card - first_card + 1);
+    return p;
+}
+
+static void minor_gc();
+static void gc_start_cycle(struct lisp_heap *heap);
+static void gc_step(struct lisp_heap *heap);
+
+/* An incremental collection has to finish before from-space fills up
+ * with what minor collections promote in the meantime.  So it starts
+ * once the room left is about what they would promote in twice the
+ * slices it should take to scan what is in from-space, going by
+ * earlier ones. */
+static size_t cycle_start_room(struct lisp_heap *heap)
+{
+    if (!heap->scanned_per_slice)
+        return heap->size_bytes / 4;
+    size_t slices = 2 * ((heap->old_freeptr - heap->from_space) / heap->scanned_per_slice + 1);
+    return slices * heap->promoted_per_minor + 2 * nursery_size(heap);
+}
+
+/* Slices of an incremental collection are taken often enough for its
+ * scan to catch up with what is in from-space, going by how much a
+ * slice scans, before it fills up with what minor collections promote.
+ * Between minor collections they are taken as allocation reaches
+ * step_at. */
+static size_t step_interval(struct lisp_heap *heap)
+{
+    size_t in_use = heap->old_freeptr - heap->from_space;
+    size_t copied = heap->to_freeptr - heap->to_space;
+    size_t left = in_use > copied ? in_use - copied : 0;
+    size_t slices = 2 * (left / heap->scanned_per_slice + 1);
+    size_t promoted = heap->promoted_per_minor ? heap->promoted_per_minor : nursery_size(heap);
+    double allocation_left = (double)old_space_free(heap) * nursery_size(heap) / promoted;
+    size_t interval = allocation_left / slices;
+    if (interval < MIN_STEP_INTERVAL)
+        return MIN_STEP_INTERVAL;
+    return interval < nursery_size(heap) ? interval : nursery_size(heap);
+}
+
+static char *allocation_limit(struct lisp_heap *heap)
+{
+    char *limit = nursery_limit(heap);
+    return heap->cycle_active && heap->step_at < limit ? heap->step_at : limit;
 }
 
-static void gc_if_needed(size_t bytes_needed)
+static char *allocate_bytes(size_t bytes_needed)
 {
     struct lisp_heap *heap = &interp->heap;
     assert_heap_invariants(heap);
-    if (heap->freeptr + bytes_needed - heap->from_space > heap->size_bytes / 2) {
-        gc();
-        size_t bytes_in_use_now = heap->freeptr - heap->from_space;
-        size_t bytes_free = heap->size_bytes / 2 - bytes_in_use_now;
-        if (bytes_free < bytes_needed) {
-            printf("Heap exhausted\n");
-            exit(1);
+    if (bytes_needed > nursery_size(heap) / LARGE_OBJECT_FRACTION)
+        return allocate_large_object(heap, bytes_needed);
+    if (heap->freeptr + bytes_needed > allocation_limit(heap)) {
+        gc_pause_begin(heap);
+        if (heap->freeptr + bytes_needed <= nursery_limit(heap)) {
+            gc_step(heap);
+        } else {
+            minor_gc();
+            if (heap->cycle_active) {
+                gc_step(heap);
+            } else if (heap->pause_budget && old_space_free(heap) < cycle_start_room(heap)) {
+                gc_start_cycle(heap);
+                gc_step(heap);
+            }
         }
+        /* Once a full nursery would not fit, collect everything (or
+         * whatever is left of an incremental collection).  While one is
+         * under way the nursery shrinks with the room left instead,
+         * down to what the largest object allocated in it needs. */
+        if (old_space_free(heap) < nursery_size(heap) / (heap->cycle_active ? LARGE_OBJECT_FRACTION : 1))
+            gc();
+        if (heap->freeptr + bytes_needed > nursery_limit(heap))
+            gc_for_room(heap, bytes_needed);
+        if (heap->freeptr + bytes_needed > nursery_limit(heap))
+            heap_exhausted();
+        gc_pause_end(heap);
     }
+    char *p = heap->freeptr;
+    heap->freeptr += bytes_needed;
+    return p;
 }
 
 lisp_object_t cons(lisp_object_t car, lisp_object_t cdr)
 {
-    struct lisp_heap *heap = &interp->heap;
-    gc_if_needed(sizeof(struct cons));
-    struct cons *the_cons = (struct cons *)heap->freeptr;
+    GC_PROTECT(car);
+    GC_PROTECT(cdr);
+    struct cons *the_cons = (struct cons *)allocate_bytes(sizeof(struct cons));
     the_cons->header = CONS_TYPE;
     the_cons->car = car;
     the_cons->cdr = cdr;
-    heap->freeptr += sizeof(struct cons);
+    the_cons->id = 0;
     return ((lisp_object_t)the_cons) | CONS_TYPE;
 }
 
+/* For passes that rewrite code: returns x itself when neither half has
+ * changed, so unchanged subtrees are shared rather than copied */
+lisp_object_t cons_if_changed(lisp_object_t x, lisp_object_t first, lisp_object_t rest)
+{
+    if (first == ConsPtr(x)->car && rest == ConsPtr(x)->cdr)
+        return x;
+    return cons(first, rest);
+}
+
+/* The elements wait on the VM stack, where the collector sees them,
+ * while the list is consed up from the end */
 lisp_object_t list(lisp_object_t first, ...)
 {
+    size_t base = interp->vm_sp;
     va_list ap;
     va_start(ap, first);
-    lisp_object_t elt = first;
-    lisp_object_t result = cons(elt, NIL);
-    lisp_object_t tail = result;
-    while ((elt = va_arg(ap, lisp_object_t)) != VARARGS_LIST_SENTINEL) {
-        rplacd(tail, cons(elt, NIL));
-        tail = cdr(tail);
-    }
+    for (lisp_object_t elt = first; elt != VARARGS_LIST_SENTINEL; elt = va_arg(ap, lisp_object_t))
+        interp->vm_stack[interp->vm_sp++] = elt;
     va_end(ap);
+    lisp_object_t result = NIL;
+    for (size_t i = interp->vm_sp; i > base; i--)
+        result = cons(interp->vm_stack[i - 1], result);
+    interp->vm_sp = base;
     return result;
 }
 
 static lisp_object_t allocate_new_symbol(lisp_object_t name)
 {
     check_string(name);
-    struct lisp_heap *heap = &interp->heap;
-    gc_if_needed(sizeof(struct symbol));
-    if (heap->freeptr >= heap->from_space + heap->size_bytes / 2)
-        abort();
-    struct symbol *s = (struct symbol *)heap->freeptr;
-    heap->freeptr += sizeof(struct symbol);
+    GC_PROTECT(name);
+    struct symbol *s = (struct symbol *)allocate_bytes(sizeof(struct symbol));
     s->header = SYMBOL_TYPE;
     s->name = name;
     s->value = NIL;
     s->function = NIL;
     s->plist = NIL;
-    lisp_object_t symbol = (uint64_t)s | SYMBOL_TYPE;
-    interp->symbol_table = cons(symbol, interp->symbol_table);
-    return symbol;
+    s->special_form = SPECIAL_FORM_NONE;
+    s->flags = 0;
+    return (uint64_t)s | SYMBOL_TYPE;
 }
 
-static lisp_object_t allocate_function()
+lisp_object_t allocate_function()
 {
-    struct lisp_heap *heap = &interp->heap;
-    gc_if_needed(sizeof(struct lisp_function));
-    if (heap->freeptr >= heap->from_space + heap->size_bytes / 2)
-        abort();
-    struct lisp_function *fn = (struct lisp_function *)heap->freeptr;
-    heap->freeptr += sizeof(struct lisp_function);
+    struct lisp_function *fn = (struct lisp_function *)allocate_bytes(sizeof(struct lisp_function));
     fn->header = FUNCTION_TYPE;
     fn->kind = NIL;
     fn->actual_function = NIL;
+    fn->environment = NIL;
+    fn->arguments = NIL;
     return (uint64_t)fn | FUNCTION_TYPE;
 }
 
-void *get_rbp(int offset)
-{
-    uint64_t *rbp;
-    asm("movq %%rbp, %0"
-        : "=r"(rbp));
-    for (int i = 0; i < offset; i++)
-        rbp = *((uint64_t **)rbp);
-    return rbp;
-}
-
 static size_t objsize(lisp_object_t obj)
 {
     if (consp(obj) != NIL)
@@ -524,6 +914,13 @@ static int object_is_in_from_space(struct lisp_heap *heap, lisp_object_t obj)
     return type > 0 && p >= heap->from_space && p < heap->from_space + heap->size_bytes / 2;
 }
 
+static int object_is_in_nursery(struct lisp_heap *heap, lisp_object_t obj)
+{
+    uint64_t type = obj & TYPE_MASK;
+    char *p = (char *)(obj & PTR_MASK);
+    return type > 0 && p >= heap->nursery && p < heap->nursery + heap->nursery_bytes;
+}
+
 static int object_is_in_to_space(struct lisp_heap *heap, lisp_object_t obj)
 {
     assert_heap_invariants(heap);
@@ -536,121 +933,119 @@ static int object_is_in_to_space(struct lisp_heap *heap, lisp_object_t obj)
 void gc_copy(struct lisp_heap *heap, lisp_object_t *p)
 {
     assert_heap_invariants(heap);
+    /* A minor collection leaves from-space where it is, and the slices
+     * of an incremental one leave the nursery, which keeps changing.
+     * As most of what they look at is elsewhere, this comes first. */
+    if (heap->collecting == GC_MINOR ? !object_is_in_nursery(heap, *p) : heap->collecting == GC_INCREMENTAL && !object_is_in_from_space(heap, *p))
+        return;
     if (*p == NIL || *p == T || *p == VARARGS_LIST_SENTINEL)
         return;
     if (consp(*p) == NIL && symbolp(*p) == NIL && stringp(*p) == NIL && vectorp(*p) == NIL && functionp(*p) == NIL)
         return;
-    if (symbolp(*p) != NIL) {
-        struct symbol *symptr = SymbolPtr(*p);
-        if (symptr->name & FORWARDING_POINTER) {
-            *p = symptr->name & ~FORWARDING_POINTER;
-            return;
-        }
-    } else if (consp(*p) != NIL) {
-        struct cons *consptr = ConsPtr(*p);
-        if (consptr->car & FORWARDING_POINTER) {
-            *p = consptr->car & ~FORWARDING_POINTER;
-            return;
-        }
-    } else if (stringp(*p) != NIL) {
-        struct string_header *string = StringPtr(*p);
-        if (string->allocated_length & FORWARDING_POINTER) {
-            *p = string->allocated_length & ~FORWARDING_POINTER;
-            return;
-        }
-    } else if (vectorp(*p) != NIL) {
-        struct vector *vector = VectorPtr(*p);
-        if (vector->len & FORWARDING_POINTER) {
-            *p = vector->len & ~FORWARDING_POINTER;
-            return;
-        }
-    } else if (functionp(*p) != NIL) {
-        struct lisp_function *fnptr = LispFunctionPtr(*p);
-        if (fnptr->kind & FORWARDING_POINTER) {
-            *p = fnptr->kind & ~FORWARDING_POINTER;
-            return;
-        }
-    } else {
-        abort();
+    /* As may slots brought up to date by gc_replay_stores() */
+    if (object_is_in_to_space(heap, *p))
+        return;
+    char *ptr = (char *)(*p & PTR_MASK);
+    uint64_t type = *p & TYPE_MASK;
+    if (HeaderForwarding(ptr)) {
+        *p = HeaderForwarding(ptr) | type;
+        return;
     }
 
     /* Copy to to-space */
     size_t size = objsize(*p);
-    void *ptr = (void *)(*p & PTR_MASK);
     memcpy(heap->freeptr, ptr, size);
-    uint64_t type = *p & TYPE_MASK;
     lisp_object_t moved_obj = ((uint64_t)heap->freeptr) | type;
     heap->freeptr += size;
-    if (symbolp(*p) != NIL)
-        SymbolPtr(*p)->name = moved_obj | FORWARDING_POINTER;
-    else if (consp(*p) != NIL)
-        ConsPtr(*p)->car = moved_obj | FORWARDING_POINTER;
-    else if (stringp(*p) != NIL)
-        StringPtr(*p)->allocated_length = moved_obj | FORWARDING_POINTER;
-    else if (vectorp(*p) != NIL)
-        VectorPtr(*p)->len = moved_obj | FORWARDING_POINTER;
-    else if (functionp(*p) != NIL)
-        LispFunctionPtr(*p)->kind = moved_obj | FORWARDING_POINTER;
-    else
-        abort();
+    *(object_header_t *)ptr = moved_obj;
     *p = moved_obj;
-    assert(object_is_in_to_space(heap, *p));
+    assert(heap->collecting == GC_MINOR ? object_is_in_from_space(heap, *p) : object_is_in_to_space(heap, *p));
+}
+
+/* Copies what is referred to by those slots of the object at p that lie
+ * between start and end.  The slots of each type of object are
+ * consecutive words. */
+static void gc_copy_slots(struct lisp_heap *heap, char *p, char *start, char *end)
+{
+    object_header_t header = HeaderType(p);
+    lisp_object_t *slots;
+    size_t count;
+    if (header == CONS_TYPE) {
+        slots = &((struct cons *)p)->car;
+        count = 2;
+    } else if (header == SYMBOL_TYPE) {
+        slots = &((struct symbol *)p)->name;
+        count = 4;
+    } else if (header == STRING_TYPE) {
+        return;
+    } else if (header == VECTOR_TYPE) {
+        slots = (lisp_object_t *)(p + sizeof(struct vector));
+        count = ((struct vector *)p)->len >> 4;
+    } else if (header == FUNCTION_TYPE) {
+        slots = &((struct lisp_function *)p)->kind;
+        count = 4;
+    } else {
+        abort();
+    }
+    lisp_object_t *first = (char *)slots < start ? (lisp_object_t *)start : slots;
+    lisp_object_t *last = (char *)(slots + count) > end ? (lisp_object_t *)end : slots + count;
+    for (lisp_object_t *slot = first; slot < last; slot++)
+        gc_copy(heap, slot);
 }
 
-static void gc_check_copied_object(lisp_object_t obj)
+/* Update pointers inside the copied object at p, which copies more,
+ * and note where it starts */
+static size_t gc_scan_object(struct lisp_heap *heap, char *p, unsigned char *object_starts, char *space)
 {
-    if (integerp(obj) != NIL || stringp(obj) != NIL || vectorp(obj) != NIL || function_pointer_p(obj) != NIL || obj == T || obj == NIL)
-        return;
-    assert(!(obj & FORWARDING_POINTER));
-    char *p = (char *)(obj & PTR_MASK);
-    assert(p >= interp->heap.from_space && p < interp->heap.from_space + interp->heap.size_bytes / 2);
+    set_object_start(object_starts, space, p);
+    size_t size = object_size_at(p);
+    gc_copy_slots(heap, p, p, p + size);
+    return size;
 }
 
-static void *ptr_demangle(void *ptr)
+static void gc_scan(struct lisp_heap *heap, char *scanptr, unsigned char *object_starts, char *space)
 {
-    asm("ror $0x11, %rdi");
-    asm("xor %fs:0x30, %rdi");
-    asm("movq %rdi, -0x8(%rbp)");
-    return ptr;
+    while (scanptr < heap->freeptr)
+        scanptr += gc_scan_object(heap, scanptr, object_starts, space);
+    assert(scanptr == heap->freeptr);
 }
 
-static int jmp_buf_entry_is_pointer[] = { 0, 1, 0, 0, 0, 0, 1, 1 };
+/* The roots stay in from-space until an incremental collection
+ * finishes, as the mutator goes on using them */
+static void gc_copy_root(struct lisp_heap *heap, lisp_object_t *p)
+{
+    lisp_object_t copy = *p;
+    gc_copy(heap, heap->collecting == GC_INCREMENTAL ? &copy : p);
+}
 
-lisp_object_t gc()
+/* Returns zero if the pause budget runs out first (see
+ * gc_budget_spent()) */
+static int gc_copy_roots(struct lisp_heap *heap, size_t *work)
 {
-    size_t bytes_in_use_before_gc = interp->heap.freeptr - interp->heap.from_space;
-    printf("; Garbage collecting ... ");
-    struct lisp_heap *heap = &interp->heap;
-    heap->freeptr = heap->to_space;
-    /* Roots - stack */
-    void *rbp = get_rbp(1);
-    assert(interp->top_of_stack);
-    for (lisp_object_t *p = interp->top_of_stack; p > (lisp_object_t *)rbp; p--)
-        if (object_is_in_from_space(heap, *p))
-            gc_copy(&interp->heap, p);
+    /* Roots - variables of C code (see GC_PROTECT()) */
+    for (size_t i = 0; i < interp->shadow_sp; i++) {
+        gc_copy_root(heap, interp->shadow_stack[i]);
+        if (gc_budget_spent(heap, work, 1))
+            return 0;
+    }
+    /* Roots - VM stack */
+    for (size_t i = 0; i < interp->vm_sp; i++) {
+        gc_copy_root(heap, &interp->vm_stack[i]);
+        if (gc_budget_spent(heap, work, 1))
+            return 0;
+    }
     /* Roots - return contexts */
-    for (struct return_context *ctxt = interp->return_stack; ctxt; ctxt = ctxt->next) {
-        gc_copy(heap, &ctxt->return_value);
-        gc_copy(heap, &ctxt->type);
-        for (int i = 0; i < ctxt->tagbody_forms_len; i++)
-            gc_copy(heap, &ctxt->tagbody_forms[i]);
-        for (int i = 0; i < 8; i++) {
-            if (jmp_buf_entry_is_pointer[i]) {
-#ifdef __GLIBC__
-                void *jmpbuf_entry = (void *)(ctxt->buf->__jmpbuf[i]);
-                lisp_object_t *p = ptr_demangle(jmpbuf_entry);
-#else
-                /* musl libc, which does not define a preprocessor symbol */
-                lisp_object_t *p = (lisp_object_t *)(ctxt->buf->__jb[i]);
-#endif
-                if (object_is_in_from_space(heap, *p))
-                    gc_copy(&interp->heap, p);
-            }
+    if (interp->return_stack) {
+        for (struct return_context *ctxt = interp->return_contexts; ctxt <= interp->return_stack; ctxt++) {
+            gc_copy_root(heap, &ctxt->return_value);
+            gc_copy_root(heap, &ctxt->type);
+            if (gc_budget_spent(heap, work, 2))
+                return 0;
         }
     }
     /* Roots - symbol table */
-    gc_copy(heap, &interp->symbol_table);
-#define GC_COPY_SYMBOL(S) gc_copy(heap, &interp->syms.S)
+    gc_copy_root(heap, &interp->symbol_table);
+#define GC_COPY_SYMBOL(S) gc_copy_root(heap, &interp->syms.S)
     GC_COPY_SYMBOL(lambda);
     GC_COPY_SYMBOL(quote);
     GC_COPY_SYMBOL(built_in_function);
@@ -667,6 +1062,7 @@ lisp_object_t gc()
     GC_COPY_SYMBOL(unquote_splice);
     GC_COPY_SYMBOL(let);
     GC_COPY_SYMBOL(integer);
+    GC_COPY_SYMBOL(fixnum);
     GC_COPY_SYMBOL(symbol);
     GC_COPY_SYMBOL(cons);
     GC_COPY_SYMBOL(string);
@@ -675,51 +1071,123 @@ lisp_object_t gc()
     GC_COPY_SYMBOL(function);
     GC_COPY_SYMBOL(return_from);
     GC_COPY_SYMBOL(pctblock);
+    GC_COPY_SYMBOL(pcttagbody);
     GC_COPY_SYMBOL(block);
     GC_COPY_SYMBOL(if_);
+    GC_COPY_SYMBOL(compiled_function);
+    GC_COPY_SYMBOL(declare);
+    GC_COPY_SYMBOL(list);
+    GC_COPY_SYMBOL(append);
+    GC_COPY_SYMBOL(raise);
+    GC_COPY_SYMBOL(inline_expansion);
+    GC_COPY_SYMBOL(inline_callers);
+    GC_COPY_SYMBOL(inline_source);
+    GC_COPY_SYMBOL(inline_function);
+    GC_COPY_SYMBOL(two_arg_function);
+    GC_COPY_SYMBOL(define_function);
 #undef GC_COPY_SYMBOL
-    /* Update pointers inside to-space objects */
-    char *scanptr;
-    for (scanptr = heap->to_space; scanptr < heap->freeptr;) {
-        object_header_t *headerptr = (object_header_t *)scanptr;
-        if (*headerptr == CONS_TYPE) {
-            struct cons *consptr = (struct cons *)scanptr;
-            gc_copy(heap, &consptr->car);
-            gc_copy(heap, &consptr->cdr);
-            scanptr += sizeof(struct cons);
-        } else if (*headerptr == SYMBOL_TYPE) {
-            struct symbol *symptr = (struct symbol *)scanptr;
-            gc_copy(heap, &symptr->name);
-            gc_copy(heap, &symptr->value);
-            gc_copy(heap, &symptr->function);
-            gc_copy(heap, &symptr->plist);
-            scanptr += sizeof(struct symbol);
-        } else if (*headerptr == STRING_TYPE) {
-            struct string_header *strptr = (struct string_header *)scanptr;
-            scanptr += strptr->allocated_length + sizeof(struct string_header);
-        } else if (*headerptr == VECTOR_TYPE) {
-            struct vector *v = (struct vector *)scanptr;
-            lisp_object_t *storage = (lisp_object_t *)(scanptr + sizeof(struct vector));
-            for (int i = 0; i < v->len >> 4; i++)
-                gc_copy(heap, storage + i);
-            scanptr += v->size_bytes;
-        } else if (*headerptr == FUNCTION_TYPE) {
-            struct lisp_function *fnptr = (struct lisp_function *)scanptr;
-            gc_copy(heap, &fnptr->kind);
-            gc_copy(heap, &fnptr->actual_function);
-            scanptr += sizeof(struct lisp_function);
-        } else {
-            abort();
+    /* Roots - macro expansion cache */
+    for (int i = 0; i < MACRO_CACHE_SIZE; i++) {
+        gc_copy_root(heap, &interp->macro_cache[i].form);
+        gc_copy_root(heap, &interp->macro_cache[i].expansion);
+        if (gc_budget_spent(heap, work, 2))
+            return 0;
+    }
+    return 1;
+}
+
+/* The first card marked in table from card i on, or ncards.  Most
+ * are not, so they are skipped a word at a time. */
+static size_t next_marked_card(unsigned char *table, size_t i, size_t ncards)
+{
+    for (; i < ncards && i % sizeof(uint64_t); i++)
+        if (table[i])
+            return i;
+    for (; i + sizeof(uint64_t) <= ncards; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, table + i, sizeof(word));
+        if (word)
+            break;
+    }
+    for (; i < ncards; i++)
+        if (table[i])
+            return i;
+    return ncards;
+}
+
+/* The objects in a card of from-space are found by walking from the
+ * last one to start at or before it */
+static char *first_object_in_card(struct lisp_heap *heap, size_t card)
+{
+    size_t index = card * CARD_SIZE / 16;
+    /* Large objects span many bytes with no bits set */
+    while (!(heap->object_starts[index / 8] & (0xff >> (7 - index % 8))))
+        index = index / 8 * 8 - 1;
+    while (!(heap->object_starts[index / 8] & (1 << (index % 8))))
+        index--;
+    return heap->from_space + index * 16;
+}
+
+/* Slots in the dirty cards of from-space (below end) are the roots
+ * that a minor collection has in old objects */
+static void gc_copy_dirty_cards(struct lisp_heap *heap, char *end)
+{
+    size_t ncards = (end - heap->from_space + CARD_SIZE - 1) / CARD_SIZE;
+    for (size_t i = next_marked_card(heap->cards, 0, ncards); i < ncards; i = next_marked_card(heap->cards, i + 1, ncards)) {
+        heap->cards[i] = 0;
+        char *card = heap->from_space + i * CARD_SIZE;
+        char *card_end = card + CARD_SIZE < end ? card + CARD_SIZE : end;
+        for (char *p = first_object_in_card(heap, i); p < card_end; p += object_size_at(p))
+            gc_copy_slots(heap, p, card, card_end);
+    }
+}
+
+/* Brings the copies of objects in mutated cards up to date with the
+ * stores made since they were copied, including those a minor
+ * collection made when it promoted what their slots referred to.
+ * Returns zero if the pause budget runs out first. */
+static int gc_replay_stores(struct lisp_heap *heap, size_t *work)
+{
+    size_t ncards = (heap->old_freeptr - heap->from_space + CARD_SIZE - 1) / CARD_SIZE;
+    for (size_t i = next_marked_card(heap->mutated_cards, 0, ncards); i < ncards; i = next_marked_card(heap->mutated_cards, i + 1, ncards)) {
+        /* The slice of an incremental collection leaves what is in the
+         * nursery where it is, so a card that refers to it is replayed
+         * again when the collection finishes */
+        if (!(heap->collecting == GC_INCREMENTAL && heap->cards[i]))
+            heap->mutated_cards[i] = 0;
+        char *card = heap->from_space + i * CARD_SIZE;
+        char *card_end = card + CARD_SIZE < heap->old_freeptr ? card + CARD_SIZE : heap->old_freeptr;
+        for (char *p = first_object_in_card(heap, i); p < card_end; p += object_size_at(p)) {
+            char *copy = (char *)HeaderForwarding(p);
+            if (!copy)
+                continue;
+            char *start = p + sizeof(object_header_t) > card ? p + sizeof(object_header_t) : card;
+            char *end = p + object_size_at(p) < card_end ? p + object_size_at(p) : card_end;
+            if (start >= end)
+                continue;
+            memcpy(copy + (start - p), start, end - start);
+            gc_copy_slots(heap, copy, copy + (start - p), copy + (end - p));
         }
+        if (gc_budget_spent(heap, work, CARD_SIZE / sizeof(lisp_object_t)))
+            return 0;
     }
-    assert(scanptr == heap->freeptr);
-    /* Swap spaces */
-    char *tmp = heap->from_space;
-    heap->from_space = heap->to_space;
-    heap->to_space = tmp;
-    /* Make assertions about copied objects */
-    for (char *p = heap->from_space; p < heap->freeptr;) {
+    return 1;
+}
+
+static void gc_check_copied_object(lisp_object_t obj)
+{
+    if (integerp(obj) != NIL || stringp(obj) != NIL || vectorp(obj) != NIL || function_pointer_p(obj) != NIL || obj == T || obj == NIL)
+        return;
+    char *p = (char *)(obj & PTR_MASK);
+    assert(p >= interp->heap.from_space && p < interp->heap.from_space + interp->heap.size_bytes / 2);
+}
+
+/* Make assertions about copied objects */
+static void gc_check_copied_objects(char *p, char *end)
+{
+    while (p < end) {
         object_header_t *headerptr = (object_header_t *)p;
+        assert(!HeaderForwarding(p));
         if (*headerptr == CONS_TYPE) {
             struct cons *c = (struct cons *)p;
             if (c->car != NIL && consp(c->car) != NIL)
@@ -741,6 +1209,8 @@ lisp_object_t gc()
             struct lisp_function *fnptr = (struct lisp_function *)p;
             gc_check_copied_object(fnptr->kind);
             gc_check_copied_object(fnptr->actual_function);
+            gc_check_copied_object(fnptr->environment);
+            gc_check_copied_object(fnptr->arguments);
             p += sizeof(struct lisp_function);
         } else {
             struct vector *v = (struct vector *)p;
@@ -750,17 +1220,333 @@ lisp_object_t gc()
             p += v->size_bytes;
         }
     }
-    /* Say how much memory was freed */
-    size_t bytes_in_use_now = interp->heap.freeptr - interp->heap.from_space;
-    printf("%lu bytes freed\n", bytes_in_use_before_gc - bytes_in_use_now);
+}
+
+/* Starts an incremental collection.  Slots that refer to the nursery
+ * are copied over when it finishes, so their cards count as mutated. */
+static void gc_start_cycle(struct lisp_heap *heap)
+{
+    heap->cycle_active = 1;
+    heap->to_freeptr = heap->to_space;
+    heap->scanptr = heap->to_space;
+    heap->scan_offset = 0;
+    memcpy(heap->mutated_cards, heap->cards, card_table_size(heap));
+}
+
+static void gc_log(struct lisp_heap *heap, char *kind, long pause, size_t bytes_before, size_t bytes_copied)
+{
+    if (!interp->gc_log)
+        return;
+    size_t in_use = heap->old_freeptr - heap->from_space;
+    fprintf(interp->gc_log, "; %s collection: %ld us, %zu of %zu bytes survived, from-space %zu%% of %zu bytes\n", kind, pause, bytes_copied, bytes_before, in_use * 100 / (heap->size_bytes / 2), heap->size_bytes / 2);
+}
+
+/* Scans to-space until it catches up, or returns zero if the pause
+ * budget runs out first.  Large objects are scanned a few slots
+ * at a time, so that one does not take the whole slice. */
+static int gc_scan_slice(struct lisp_heap *heap, size_t *work)
+{
+    size_t chunk = SLOTS_BETWEEN_CLOCK_CHECKS * sizeof(lisp_object_t);
+    while (heap->scanptr < heap->freeptr) {
+        char *p = heap->scanptr;
+        size_t size = object_size_at(p);
+        if (!heap->scan_offset)
+            set_object_start(heap->to_space_object_starts, heap->to_space, p);
+        size_t end = size - heap->scan_offset > chunk ? heap->scan_offset + chunk : size;
+        gc_copy_slots(heap, p, p + heap->scan_offset, p + end);
+        size_t slots = (end - heap->scan_offset) / sizeof(lisp_object_t);
+        heap->scan_offset = end == size ? 0 : end;
+        if (!heap->scan_offset)
+            heap->scanptr += size;
+        if (gc_budget_spent(heap, work, slots))
+            return 0;
+    }
+    return 1;
+}
+
+static void gc_finish_cycle(struct lisp_heap *heap, long start);
+
+/* Does a slice of an incremental collection, in what is left of the
+ * pause budget.  The roots stay in from-space, and only what they
+ * refer to is copied.  Once the scan has caught up, the slice tries to
+ * finish the collection: it copies the roots again, brings the copies
+ * of objects in mutated cards up to date, and scans whatever that
+ * copies.  If all of that fits in the slice, everything the mutator can
+ * reach has a copy that is up to date, so flipping the spaces takes
+ * little more than pointing the roots at the copies.  If not, the next
+ * slice goes on from where this one stopped. */
+static void gc_step(struct lisp_heap *heap)
+{
+    long start = monotonic_microseconds();
+    char *nursery_freeptr = heap->freeptr;
+    char *scanned_from = heap->scanptr;
+    heap->freeptr = heap->to_freeptr;
+    heap->collecting = GC_INCREMENTAL;
+    size_t work = 0;
+    int caught_up = gc_scan_slice(heap, &work) && gc_copy_roots(heap, &work) && gc_replay_stores(heap, &work) && gc_scan_slice(heap, &work);
+    heap->collecting = GC_FULL;
+    heap->to_freeptr = heap->freeptr;
+    heap->freeptr = nursery_freeptr;
+    heap->stats.increments++;
+    size_t scanned = heap->scanptr - scanned_from;
+    heap->scanned_per_slice = heap->scanned_per_slice ? (3 * heap->scanned_per_slice + scanned) / 4 : scanned;
+    if (heap->scanned_per_slice < sizeof(struct cons))
+        heap->scanned_per_slice = sizeof(struct cons);
+    if (interp->gc_log)
+        fprintf(interp->gc_log, "; incremental step: %ld us, %zu bytes copied so far\n", monotonic_microseconds() - start, heap->to_freeptr - heap->to_space);
+    if (caught_up)
+        gc_finish_cycle(heap, start);
+    else
+        heap->step_at = heap->freeptr + step_interval(heap);
+}
+
+/* Copies whatever has not been copied yet, and flips the spaces */
+static void gc_finish_cycle(struct lisp_heap *heap, long start)
+{
+    size_t bytes_in_use_before_gc = (heap->old_freeptr - heap->from_space) + (heap->freeptr - heap->nursery);
+    size_t semispace_bytes = heap->size_bytes / 2;
+    heap->freeptr = heap->to_freeptr;
+    gc_copy_roots(heap, NULL);
+    gc_replay_stores(heap, NULL);
+    gc_scan(heap, heap->scanptr, heap->to_space_object_starts, heap->to_space);
+    /* Swap spaces */
+    char *tmp = heap->from_space;
+    heap->from_space = heap->to_space;
+    heap->to_space = tmp;
+    unsigned char *tmp_starts = heap->object_starts;
+    heap->object_starts = heap->to_space_object_starts;
+    heap->to_space_object_starts = tmp_starts;
+    memset(heap->to_space_object_starts, 0, object_starts_size(heap));
+    heap->old_freeptr = heap->freeptr;
+    heap->freeptr = heap->nursery;
+    memset(heap->cards, 0, card_table_size(heap));
+    memset(heap->mutated_cards, 0, card_table_size(heap));
+    heap->cycle_active = 0;
+    /* This looks at all of from-space, which a pause budget has no
+     * room for */
+    if (!heap->pause_budget)
+        gc_check_copied_objects(heap->from_space, heap->old_freeptr);
+    heap_adapt(heap, 0);
+    size_t bytes_in_use_now = heap->old_freeptr - heap->from_space;
+    heap->stats.full_collections++;
+    heap->stats.bytes_collected += bytes_in_use_before_gc;
+    heap->stats.bytes_copied += bytes_in_use_now;
+    heap->stats.occupancy_before = bytes_in_use_before_gc * 100 / semispace_bytes;
+    heap->stats.occupancy_after = bytes_in_use_now * 100 / (heap->size_bytes / 2);
+    gc_log(heap, "full", monotonic_microseconds() - start, bytes_in_use_before_gc, bytes_in_use_now);
+}
+
+/* Collects everything at once, or finishes an incremental collection */
+lisp_object_t gc()
+{
+    struct lisp_heap *heap = &interp->heap;
+    long start = monotonic_microseconds();
+    gc_pause_begin(heap);
+    if (!heap->cycle_active)
+        gc_start_cycle(heap);
+    gc_finish_cycle(heap, start);
+    gc_pause_end(heap);
     return T;
 }
 
+/* Only while the nursery and to-space are empty, and what is in
+ * from-space fits */
+static void heap_resize(struct lisp_heap *heap, size_t bytes)
+{
+    size_t old_object_starts_size = object_starts_size(heap);
+    heap->size_bytes = bytes;
+    heap->nursery_bytes = (bytes / NURSERY_FRACTION) & ~(size_t)15;
+    if (heap->nursery_target > heap->nursery_bytes)
+        heap->nursery_target = heap->nursery_bytes;
+    commit_heap(heap);
+    heap->cards = realloc(heap->cards, card_table_size(heap));
+    memset(heap->cards, 0, card_table_size(heap));
+    heap->mutated_cards = realloc(heap->mutated_cards, card_table_size(heap));
+    memset(heap->mutated_cards, 0, card_table_size(heap));
+    heap->object_starts = realloc(heap->object_starts, object_starts_size(heap));
+    if (object_starts_size(heap) > old_object_starts_size)
+        memset(heap->object_starts + old_object_starts_size, 0, object_starts_size(heap) - old_object_starts_size);
+    heap->to_space_object_starts = realloc(heap->to_space_object_starts, object_starts_size(heap));
+    memset(heap->to_space_object_starts, 0, object_starts_size(heap));
+}
+
+/* Called at the end of a full collection.  The heap grows as soon as
+ * what survived, and bytes_needed more, would fill more than the target
+ * occupancy of from-space, but only shrinks once it would fill less
+ * than half of that, so that a steady workload does not resize it after
+ * every collection. */
+static void heap_adapt(struct lisp_heap *heap, size_t bytes_needed)
+{
+    size_t live = heap->old_freeptr - heap->from_space;
+    size_t bytes = 2 * round_up((live + bytes_needed) * 100 / heap->target_occupancy, sysconf(_SC_PAGESIZE));
+    if (bytes < heap->min_bytes)
+        bytes = heap->min_bytes;
+    if (bytes > heap->max_bytes)
+        bytes = heap->max_bytes;
+    if (bytes / 2 < live)
+        return;
+    if (bytes > heap->size_bytes || 2 * bytes <= heap->size_bytes || heap->size_bytes > heap->max_bytes)
+        heap_resize(heap, bytes);
+}
+
+/* Promotes whatever survives in the nursery to the end of from-space.
+ * Nothing already in from-space is traced: its objects are all taken
+ * to be live, and those that may refer to the nursery are found from
+ * the cards marked by write_barrier(). */
+static void minor_gc()
+{
+    struct lisp_heap *heap = &interp->heap;
+    long start = monotonic_microseconds();
+    size_t nursery_bytes_in_use = heap->freeptr - heap->nursery;
+    char *promoted = heap->old_freeptr;
+    heap->freeptr = heap->old_freeptr;
+    heap->collecting = GC_MINOR;
+    gc_copy_roots(heap, NULL);
+    gc_copy_dirty_cards(heap, promoted);
+    gc_scan(heap, promoted, heap->object_starts, heap->from_space);
+    heap->collecting = GC_FULL;
+    gc_check_copied_objects(promoted, heap->freeptr);
+    heap->old_freeptr = heap->freeptr;
+    heap->freeptr = heap->nursery;
+    size_t promoted_bytes = heap->old_freeptr - promoted;
+    heap->stats.minor_collections++;
+    heap->stats.bytes_collected += nursery_bytes_in_use;
+    heap->stats.bytes_copied += promoted_bytes;
+    heap->promoted_per_minor = (3 * heap->promoted_per_minor + promoted_bytes) / 4;
+    long pause = monotonic_microseconds() - start;
+    gc_log(heap, "minor", pause, nursery_bytes_in_use, promoted_bytes);
+    /* Leave at least half the pause budget to a slice of an incremental
+     * collection */
+    if (heap->pause_budget && pause > heap->pause_budget / 2) {
+        size_t min_bytes = MIN_NURSERY_BYTES < heap->nursery_bytes ? MIN_NURSERY_BYTES : heap->nursery_bytes;
+        heap->nursery_target = (heap->nursery_target / 2) & ~(size_t)15;
+        if (heap->nursery_target < min_bytes)
+            heap->nursery_target = min_bytes;
+    } else if (heap->pause_budget && pause < heap->pause_budget / 4 && nursery_bytes_in_use >= heap->nursery_target / 2) {
+        heap->nursery_target = 2 * heap->nursery_target < heap->nursery_bytes ? 2 * heap->nursery_target : heap->nursery_bytes;
+    }
+}
+
+/* Every store into an object that may have been allocated before the
+ * last allocation goes through here, after the store */
+void write_barrier(lisp_object_t *slot, lisp_object_t value)
+{
+    struct lisp_heap *heap = &interp->heap;
+    char *p = (char *)slot;
+    if (p >= heap->from_space && p < heap->old_freeptr) {
+        size_t card = (p - heap->from_space) / CARD_SIZE;
+        if (object_is_in_nursery(heap, value))
+            heap->cards[card] = 1;
+        if (heap->cycle_active)
+            heap->mutated_cards[card] = 1;
+    }
+}
+
+/* The same for stores of anything other than a Lisp object */
+void write_barrier_bytes(void *p, size_t len)
+{
+    struct lisp_heap *heap = &interp->heap;
+    char *start = p;
+    if (heap->cycle_active && start >= heap->from_space && start < heap->old_freeptr) {
+        size_t first_card = (start - heap->from_space) / CARD_SIZE;
+        size_t last_card = (start + len - 1 - heap->from_space) / CARD_SIZE;
+        memset(heap->mutated_cards + first_card, 1, last_card - first_card + 1);
+    }
+}
+
+/* The variable is registered before raising stack-overflow, so that
+ * raising it does not reach the limit again */
+lisp_object_t *gc_protect(lisp_object_t *var)
+{
+    if (interp->shadow_sp == SHADOW_STACK_SIZE)
+        abort();
+    interp->shadow_stack[interp->shadow_sp++] = var;
+    if (interp->shadow_sp == SHADOW_STACK_SIZE - SHADOW_STACK_RESERVE)
+        raise_condition("stack-overflow", NIL);
+    return var;
+}
+
+/* The cleanup of a GC_PROTECT() variable, which is the last one
+ * registered that is still in scope.  Initialization registers some
+ * too, while a variable can go out of scope after free_interpreter(). */
+void gc_unprotect(lisp_object_t **root)
+{
+    if (!interp)
+        return;
+    assert(interp->shadow_sp > 0 && interp->shadow_stack[interp->shadow_sp - 1] == *root);
+    interp->shadow_sp--;
+}
+
+/* Zero leaves a setting as it is.  They take effect at the next full
+ * collection. */
+void set_heap_limits(size_t min_bytes, size_t max_bytes, int target_occupancy)
+{
+    struct lisp_heap *heap = &interp->heap;
+    if (min_bytes)
+        heap->min_bytes = round_up(min_bytes, 32);
+    if (max_bytes)
+        heap->max_bytes = max_bytes < 2 * LISP_SEMISPACE_RESERVE ? max_bytes & ~(size_t)31 : 2 * LISP_SEMISPACE_RESERVE;
+    if (target_occupancy)
+        heap->target_occupancy = target_occupancy;
+    assert(heap->min_bytes <= heap->max_bytes);
+    assert(heap->target_occupancy > 0 && heap->target_occupancy <= 100);
+}
+
+/* Zero, the default, collects everything at once.  Otherwise the
+ * nursery starts out small, and grows while minor collections leave
+ * enough of the budget. */
+void set_gc_pause(long microseconds)
+{
+    struct lisp_heap *heap = &interp->heap;
+    heap->pause_budget = microseconds;
+    heap->nursery_target = MIN_NURSERY_BYTES < heap->nursery_bytes ? MIN_NURSERY_BYTES : heap->nursery_bytes;
+}
+
+/* Null, the default, turns the log off */
+void set_gc_log(FILE *log)
+{
+    interp->gc_log = log;
+}
+
+/* An alist of the statistics, with the survival rate in percent */
+lisp_object_t gc_statistics()
+{
+    /* Copied first, as building the list may well collect */
+    struct gc_stats stats = interp->heap.stats;
+    struct {
+        char *name;
+        size_t value;
+    } fields[] = {
+        { "full-collections", stats.full_collections },
+        { "minor-collections", stats.minor_collections },
+        { "increments", stats.increments },
+        { "total-pause", stats.total_pause },
+        { "max-pause", stats.max_pause },
+        { "bytes-copied", stats.bytes_copied },
+        { "survival-rate", stats.bytes_collected ? stats.bytes_copied * 100 / stats.bytes_collected : 0 },
+        { "occupancy-before", stats.occupancy_before },
+        { "occupancy-after", stats.occupancy_after },
+        { "heap-size", interp->heap.size_bytes },
+    };
+    lisp_object_t result = NIL;
+    GC_PROTECT(result);
+    for (int i = sizeof(fields) / sizeof(fields[0]) - 1; i >= 0; i--) {
+        lisp_object_t field = cons(sym(fields[i].name), fields[i].value << 4);
+        result = cons(field, result);
+    }
+    return result;
+}
+
 void free_interpreter()
 {
     if (interpreter_initialized) {
         lisp_heap_free(&interp->heap);
+        free(interp->vm_stack);
+        free(interp->shadow_stack);
+        free(interp->return_contexts);
+        free(interp->macro_cache);
         free(interp);
+        interp = NULL;
         interpreter_initialized = 0;
     }
 }
@@ -774,17 +1560,28 @@ lisp_object_t allocate_string(size_t len, char *str)
      */
     size_t bytes_to_allocate_for_actual_string = ((len / 16) + 1) * 16;
     size_t total_bytes_to_allocate = sizeof(struct string_header) + bytes_to_allocate_for_actual_string;
-    gc_if_needed(total_bytes_to_allocate);
-    struct string_header *new_string = (struct string_header *)interp->heap.freeptr;
+    struct string_header *new_string = (struct string_header *)allocate_bytes(total_bytes_to_allocate);
     new_string->header = STRING_TYPE;
     new_string->allocated_length = bytes_to_allocate_for_actual_string;
     new_string->string_length = len;
     char *new_string_storage = ((char *)new_string) + sizeof(struct string_header);
-    interp->heap.freeptr += total_bytes_to_allocate;
     strncpy(new_string_storage, str, len);
     return (lisp_object_t)new_string | STRING_TYPE;
 }
 
+/* A zero-filled string of len bytes, used as a buffer for binary data */
+lisp_object_t allocate_blank_string(size_t len)
+{
+    size_t bytes_to_allocate_for_actual_string = ((len / 16) + 1) * 16;
+    size_t total_bytes_to_allocate = sizeof(struct string_header) + bytes_to_allocate_for_actual_string;
+    struct string_header *new_string = (struct string_header *)allocate_bytes(total_bytes_to_allocate);
+    new_string->header = STRING_TYPE;
+    new_string->allocated_length = bytes_to_allocate_for_actual_string;
+    new_string->string_length = len + 1;
+    memset(((char *)new_string) + sizeof(struct string_header), 0, bytes_to_allocate_for_actual_string);
+    return (lisp_object_t)new_string | STRING_TYPE;
+}
+
 void get_string_parts(lisp_object_t string, size_t *lenptr, char **strptr)
 {
     check_string(string);
@@ -816,27 +1613,99 @@ lisp_object_t symbol_name(lisp_object_t sym)
     return SymbolPtr(sym)->name;
 }
 
-lisp_object_t find_symbol(lisp_object_t list_of_symbols, lisp_object_t name)
+/* Symbol table */
+
+static lisp_object_t make_symbol_table(size_t capacity)
 {
-    check_string(name);
-    if (list_of_symbols == NIL)
-        return NIL;
-    check_cons(list_of_symbols);
-    lisp_object_t first = car(list_of_symbols);
-    if (string_equalp(symbol_name(first), name) == T)
-        return first;
-    else
-        return find_symbol(cdr(list_of_symbols), name);
+    lisp_object_t table = allocate_vector((SYMBOL_TABLE_FIRST_ENTRY + capacity) << 4);
+    VectorStorage(table)[SYMBOL_TABLE_COUNT] = 0;
+    return table;
 }
 
-lisp_object_t allocate_symbol(lisp_object_t name)
+static size_t symbol_table_capacity(lisp_object_t table)
 {
-    lisp_object_t preexisting_symbol = find_symbol(interp->symbol_table, name);
-    if (preexisting_symbol != NIL) {
-        return preexisting_symbol;
-    } else {
-        return allocate_new_symbol(name);
+    return (VectorPtr(table)->len >> 4) - SYMBOL_TABLE_FIRST_ENTRY;
+}
+
+/* FNV-1a */
+static uint64_t hash_symbol_name(char *name, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/* Returns the entry holding the symbol with the name, or the empty one
+ * where it would go.  The pointer is only good until the next
+ * allocation. */
+static lisp_object_t *symbol_table_probe(lisp_object_t table, char *name, size_t len)
+{
+    size_t mask = symbol_table_capacity(table) - 1;
+    lisp_object_t *entries = VectorStorage(table) + SYMBOL_TABLE_FIRST_ENTRY;
+    for (size_t i = hash_symbol_name(name, len) & mask;; i = (i + 1) & mask) {
+        if (entries[i] == NIL)
+            return &entries[i];
+        size_t entry_len;
+        char *entry_name;
+        get_string_parts(SymbolPtr(entries[i])->name, &entry_len, &entry_name);
+        if (entry_len == len && memcmp(entry_name, name, len) == 0)
+            return &entries[i];
+    }
+}
+
+static void grow_symbol_table()
+{
+    lisp_object_t table = make_symbol_table(2 * symbol_table_capacity(interp->symbol_table));
+    lisp_object_t old_table = interp->symbol_table;
+    size_t old_capacity = symbol_table_capacity(old_table);
+    for (size_t i = 0; i < old_capacity; i++) {
+        lisp_object_t symbol = VectorStorage(old_table)[SYMBOL_TABLE_FIRST_ENTRY + i];
+        if (symbol != NIL) {
+            size_t len;
+            char *name;
+            get_string_parts(SymbolPtr(symbol)->name, &len, &name);
+            *symbol_table_probe(table, name, len) = symbol;
+        }
     }
+    VectorStorage(table)[SYMBOL_TABLE_COUNT] = VectorStorage(old_table)[SYMBOL_TABLE_COUNT];
+    interp->symbol_table = table;
+}
+
+/* Never allocates */
+lisp_object_t find_symbol(char *name)
+{
+    return *symbol_table_probe(interp->symbol_table, name, strlen(name));
+}
+
+/* name must not point into the heap, as allocating may move it */
+lisp_object_t intern(char *name)
+{
+    size_t len = strlen(name);
+    lisp_object_t symbol = *symbol_table_probe(interp->symbol_table, name, len);
+    if (symbol != NIL)
+        return symbol;
+    lisp_object_t count = VectorStorage(interp->symbol_table)[SYMBOL_TABLE_COUNT];
+    /* Keep the table at most half full */
+    if (2 * ((count >> 4) + 1) > symbol_table_capacity(interp->symbol_table))
+        grow_symbol_table();
+    symbol = allocate_new_symbol(allocate_string(len + 1 /* include terminating null */, name));
+    lisp_object_t *slot = symbol_table_probe(interp->symbol_table, name, len);
+    *slot = symbol;
+    write_barrier(slot, symbol);
+    VectorStorage(interp->symbol_table)[SYMBOL_TABLE_COUNT] = count + (1 << 4);
+    write_barrier(&VectorStorage(interp->symbol_table)[SYMBOL_TABLE_COUNT], count + (1 << 4));
+    return symbol;
+}
+
+/* An uninterned symbol, which the collector can reclaim like anything
+ * else once it is unreachable */
+lisp_object_t make_symbol(lisp_object_t name)
+{
+    check_string(name);
+    return allocate_new_symbol(name);
 }
 
 lisp_object_t gensym()
@@ -847,10 +1716,11 @@ lisp_object_t gensym()
         symptr->value = 0;
     else if (integerp(value) != NIL)
         symptr->value += 1 << 4;
+    write_barrier(&symptr->value, symptr->value);
     int n = symptr->value >> 4;
     char *name = alloca(16);
     sprintf(name, "g%d", n);
-    return sym(name);
+    return make_symbol(allocate_string(strlen(name) + 1, name));
 }
 
 lisp_object_t getprop(lisp_object_t sym, lisp_object_t ind)
@@ -867,14 +1737,25 @@ lisp_object_t getprop(lisp_object_t sym, lisp_object_t ind)
 lisp_object_t putprop(lisp_object_t sym, lisp_object_t ind, lisp_object_t value)
 {
     check_symbol(sym);
+    GC_PROTECT(sym);
+    GC_PROTECT(ind);
+    GC_PROTECT(value);
     struct symbol *symptr = SymbolPtr(sym);
     for (lisp_object_t o = symptr->plist; o != NIL; o = cdr(o)) {
-        if (eq(car(o), ind) != NIL) {
-            rplacd(o, value);
+        if (eq(car(car(o)), ind) != NIL) {
+            rplacd(car(o), value);
+            if (ind == interp->syms.macro)
+                interp->function_epoch++;
             return value;
         }
     }
-    symptr->plist = cons(cons(ind, value), symptr->plist);
+    lisp_object_t property = cons(ind, value);
+    /* The cons may have moved the symbol */
+    lisp_object_t plist = cons(property, SymbolPtr(sym)->plist);
+    SymbolPtr(sym)->plist = plist;
+    write_barrier(&SymbolPtr(sym)->plist, plist);
+    if (ind == interp->syms.macro)
+        interp->function_epoch++;
     return value;
 }
 
@@ -885,7 +1766,7 @@ lisp_object_t parse_symbol(char *str)
     else if (strcmp(str, "t") == 0)
         return T;
     else
-        return allocate_symbol(allocate_string(strlen(str) + 1 /* include terminating null */, str));
+        return intern(str);
 }
 
 static char tspeek(struct text_stream *ts)
@@ -930,6 +1811,7 @@ lisp_object_t parse_cons(struct text_stream *ts)
 {
     skip_whitespace(ts);
     lisp_object_t new_cons = cons(parse1(ts), NIL);
+    GC_PROTECT(new_cons);
     skip_whitespace(ts);
     if (tspeek(ts) == '.') {
         text_stream_advance(ts);
@@ -941,7 +1823,8 @@ lisp_object_t parse_cons(struct text_stream *ts)
         text_stream_advance(ts);
         return new_cons;
     } else {
-        /* This temporary is needed to get the value on the stack for the GC to see */
+        /* This temporary is needed so that new_cons is not looked at
+         * until parse_cons() has finished moving it */
         lisp_object_t tmp = parse_cons(ts);
         rplacd(new_cons, tmp);
     }
@@ -963,7 +1846,11 @@ int length_c(lisp_object_t seq)
         for (obj = seq; obj != NIL; obj = cdr(obj))
             result++;
     } else {
-        abort();
+        static char buf[1024];
+        char *obj_string = print_object(seq);
+        int len = snprintf(buf, 1024, "Not a sequence: %s", obj_string);
+        free(obj_string);
+        raise_condition("type-error", allocate_string(len + 1, buf));
     }
     return result;
 }
@@ -984,6 +1871,7 @@ lisp_object_t parse_vector(struct text_stream *ts)
         return allocate_vector(0);
     }
     lisp_object_t list = parse_cons(ts);
+    GC_PROTECT(list);
     int len = length_c(list);
     lisp_object_t vector = allocate_vector(len << 4);
     /* Copy the list into a vector */
@@ -994,6 +1882,14 @@ lisp_object_t parse_vector(struct text_stream *ts)
     return vector;
 }
 
+/* Reads the form after 'x, `x, ,x, ,@x or #'x as (symbol x).  The
+ * symbol is passed by reference, as reading may move it. */
+static lisp_object_t parse_abbreviation(struct text_stream *ts, lisp_object_t *symbol)
+{
+    lisp_object_t form = cons(parse1(ts), NIL);
+    return cons(*symbol, form);
+}
+
 lisp_object_t parse_dispatch(struct text_stream *ts)
 {
     assert(tspeek(ts) == '#');
@@ -1005,7 +1901,7 @@ lisp_object_t parse_dispatch(struct text_stream *ts)
         return parse_vector(ts);
     case '\'':
         text_stream_advance(ts);
-        return cons(interp->syms.function, cons(parse1(ts), NIL));
+        return parse_abbreviation(ts, &interp->syms.function);
     default:
         abort();
     }
@@ -1018,17 +1914,17 @@ lisp_object_t parse1(struct text_stream *ts)
         abort();
     } else if (tspeek(ts) == '\'') {
         text_stream_advance(ts);
-        return cons(interp->syms.quote, cons(parse1(ts), NIL));
+        return parse_abbreviation(ts, &interp->syms.quote);
     } else if (tspeek(ts) == '`') {
         text_stream_advance(ts);
-        return cons(interp->syms.quasiquote, cons(parse1(ts), NIL));
+        return parse_abbreviation(ts, &interp->syms.quasiquote);
     } else if (tspeek(ts) == ',') {
         text_stream_advance(ts);
         if (tspeek(ts) == '@') {
             text_stream_advance(ts);
-            return cons(interp->syms.unquote_splice, cons(parse1(ts), NIL));
+            return parse_abbreviation(ts, &interp->syms.unquote_splice);
         } else {
-            return cons(interp->syms.unquote, cons(parse1(ts), NIL));
+            return parse_abbreviation(ts, &interp->syms.unquote);
         }
     } else if (tspeek(ts) == '(') {
         text_stream_advance(ts);
@@ -1329,8 +2225,12 @@ lisp_object_t sublis(lisp_object_t a, lisp_object_t y)
 {
     if (atom(y) != NIL)
         return sub2(a, y);
-    else
-        return cons(sublis(a, car(y)), sublis(a, cdr(y)));
+    GC_PROTECT(a);
+    GC_PROTECT(y);
+    lisp_object_t first = sublis(a, car(y));
+    GC_PROTECT(first);
+    lisp_object_t rest = sublis(a, cdr(y));
+    return cons(first, rest);
 }
 
 lisp_object_t null(lisp_object_t obj)
@@ -1342,8 +2242,9 @@ lisp_object_t append(lisp_object_t x, lisp_object_t y)
 {
     if (null(x) != NIL)
         return y;
-    else
-        return cons(car(x), append(cdr(x), y));
+    GC_PROTECT(x);
+    lisp_object_t rest = append(cdr(x), y);
+    return cons(car(x), rest);
 }
 
 lisp_object_t member(lisp_object_t x, lisp_object_t y)
@@ -1366,96 +2267,207 @@ lisp_object_t assoc(lisp_object_t x, lisp_object_t a)
         return assoc(x, cdr(a));
 }
 
-/* originally McCarthy's PAIRLIS */
-lisp_object_t pairlis2(lisp_object_t x, lisp_object_t y, lisp_object_t a)
-{
-    if (x == NIL)
-        if (y != NIL)
-            return raise(sym("bad-args"), y);
-        else
-            return a;
-    else if (eq(car(x), interp->syms.amprest) != NIL || eq(car(x), interp->syms.ampbody) != NIL)
-        return cons(cons(cadr(x), y), a);
-    else if (eq(car(x), interp->syms.ampoptional) != NIL)
-        return cons(cons(cadr(x), car(y)), NIL);
-    else if (y == NIL)
-        return raise(sym("bad-args"), x);
-    else
-        return cons(cons(car(x), car(y)), pairlis2(cdr(x), cdr(y), a));
+lisp_object_t parse_lambda_list(lisp_object_t lambda_list)
+{
+    int required = 0, optional = 0, rest = 0;
+    int in_optional = 0;
+    lisp_object_t vars = NIL;
+    GC_PROTECT(vars);
+    lisp_object_t x = lambda_list;
+    GC_PROTECT(x);
+    for (; x != NIL; x = cdr(x)) {
+        lisp_object_t var = car(x);
+        if (var == interp->syms.ampoptional) {
+            in_optional = 1;
+        } else if (var == interp->syms.amprest || var == interp->syms.ampbody) {
+            vars = cons(cadr(x), vars);
+            rest = 1;
+            break;
+        } else {
+            vars = cons(var, vars);
+            if (in_optional)
+                optional++;
+            else
+                required++;
+        }
+    }
+    lisp_object_t ordered_vars = NIL;
+    for (; vars != NIL; vars = cdr(vars))
+        ordered_vars = cons(car(vars), ordered_vars);
+    return cons(MAKE_LAMBDA_LIST_COUNTS(required, optional, rest), ordered_vars);
+}
+
+/* Binds args to the variables of a parsed lambda list in a new frame */
+lisp_object_t make_frame(lisp_object_t parsed_lambda_list, lisp_object_t args, lisp_object_t parent)
+{
+    GC_PROTECT(parsed_lambda_list);
+    GC_PROTECT(args);
+    GC_PROTECT(parent);
+    lisp_object_t counts = car(parsed_lambda_list);
+    int required = LAMBDA_LIST_REQUIRED(counts);
+    int optional = LAMBDA_LIST_OPTIONAL(counts);
+    int rest = LAMBDA_LIST_REST(counts);
+    lisp_object_t frame = allocate_vector((FRAME_FIRST_SLOT + required + optional + rest) << 4);
+    lisp_object_t *slots = VectorStorage(frame);
+    slots[FRAME_PARENT] = parent;
+    slots[FRAME_VARIABLES] = cdr(parsed_lambda_list);
+    slots += FRAME_FIRST_SLOT;
+    for (int i = 0; i < required; i++, args = cdr(args)) {
+        if (args == NIL)
+            return raise_condition("bad-args", cdr(parsed_lambda_list));
+        *slots++ = car(args);
+    }
+    for (int i = 0; i < optional; i++, args = cdr(args))
+        *slots++ = car(args);
+    if (rest)
+        *slots = args;
+    else if (args != NIL)
+        return raise_condition("bad-args", args);
+    return frame;
 }
 
-static void push_return_context(lisp_object_t type)
+void push_return_context(lisp_object_t type)
 {
-    struct return_context *ctxt = malloc(sizeof(struct return_context));
+    struct return_context *ctxt = interp->return_stack ? interp->return_stack + 1 : interp->return_contexts;
+    if (ctxt == interp->return_contexts + RETURN_STACK_SIZE)
+        raise(sym("stack-overflow"), NIL);
     ctxt->type = type;
-    ctxt->next = interp->return_stack;
     ctxt->return_value = NIL;
-    ctxt->tagbody_forms = NULL;
-    ctxt->tagbody_forms_len = 0;
+    ctxt->shadow_sp = interp->shadow_sp;
+    ctxt->vm_sp = interp->vm_sp;
+    ctxt->vm_pc = 0;
     interp->return_stack = ctxt;
 }
 
-static lisp_object_t pop_return_context()
+/* A condition-case has a single context whatever the number of
+ * clauses.  clauses is an alist keyed by the symbols it handles; when
+ * raise() picks the context it replaces them with the condition */
+/* Clauses of t, rather than a list, handle every condition */
+void push_condition_case_context(lisp_object_t clauses)
+{
+    push_return_context(interp->syms.condition_case);
+    interp->return_stack->return_value = clauses;
+}
+
+static int context_handles(struct return_context *ctxt, lisp_object_t sym)
+{
+    if (ctxt->type == interp->syms.condition_case)
+        return ctxt->return_value == T || assoc(sym, ctxt->return_value) != NIL;
+    return ctxt->type == sym;
+}
+
+lisp_object_t pop_return_context()
 {
     struct return_context *ctxt = interp->return_stack;
-    lisp_object_t retval = ctxt->return_value;
-    interp->return_stack = ctxt->next;
-    if (ctxt->tagbody_forms)
-        free(ctxt->tagbody_forms);
-    free(ctxt);
-    return retval;
+    interp->return_stack = ctxt == interp->return_contexts ? NULL : ctxt - 1;
+    return ctxt->return_value;
 }
 
 lisp_object_t raise(lisp_object_t sym, lisp_object_t value)
 {
-    while (interp->return_stack && interp->return_stack->type != sym)
+    GC_PROTECT(sym);
+    GC_PROTECT(value);
+    while (interp->return_stack && !context_handles(interp->return_stack, sym))
         pop_return_context();
     if (!interp->return_stack) {
-        char *message = print_object(cons(sym, cons(value, NIL)));
+        char *message = print_object(List(sym, value));
         printf("Unhandled exception: %s\n", message);
         free(message);
         abort();
     }
+    if (interp->return_stack->type == interp->syms.condition_case)
+        value = cons(sym, value);
     interp->return_stack->return_value = value;
-    longjmp(interp->return_stack->buf, 1);
+    interp->vm_sp = interp->return_stack->vm_sp;
+    interp->shadow_sp = interp->return_stack->shadow_sp;
+    __builtin_longjmp(interp->return_stack->buf, 1);
     return NIL; /* we never actually return */
 }
 
+/* For conditions raised by C code: the name is only interned once value
+ * is somewhere the collector can update it */
+lisp_object_t raise_condition(char *name, lisp_object_t value)
+{
+    GC_PROTECT(value);
+    lisp_object_t condition = sym(name);
+    return raise(condition, value);
+}
+
 static lisp_object_t apply_lambda(lisp_object_t fn, lisp_object_t x, lisp_object_t a)
 {
+    GC_PROTECT(fn);
     lisp_object_t retval = NIL;
-    lisp_object_t env = pairlis2(cadr(fn), x, a);
-    for (lisp_object_t expr = cddr(fn); expr != NIL; expr = cdr(expr))
+    lisp_object_t env = make_frame(LispFunctionPtr(fn)->arguments, x, a);
+    GC_PROTECT(env);
+    lisp_object_t expr = cddr(LispFunctionPtr(fn)->actual_function);
+    GC_PROTECT(expr);
+    for (; expr != NIL; expr = cdr(expr))
         retval = eval(car(expr), env);
     return retval;
 }
 
-static lisp_object_t apply_built_in_function(lisp_object_t fn, lisp_object_t x, lisp_object_t a)
-{
-    check_function_pointer(cadr(fn));
-    void (*fp)() = FunctionPtr(cadr(fn));
-    int arity = ((int64_t)caddr(fn)) >> 4;
+/* The arguments must stay visible to the garbage collector until the
+ * call returns, which they are on the VM stack */
+lisp_object_t call_native_function(lisp_object_t fn, int nargs, lisp_object_t *args, lisp_object_t a)
+{
+    struct native_function *native = NativeFunctionPtr(fn);
+    check_function_pointer(native->entry);
+    void (*fp)() = FunctionPtr(native->entry);
+    int arity = native->arity >> 4;
+    if (native->flags & NATIVE_VARIADIC) {
+        if (nargs < arity) {
+            lisp_object_t x = NIL;
+            for (int i = nargs - 1; i >= 0; i--)
+                x = cons(args[i], x);
+            return raise_condition("bad-args", x);
+        }
+        return ((lisp_object_t(*)(int, lisp_object_t *, lisp_object_t))fp)(nargs, args, a);
+    }
+    /* Missing arguments are nil and extra ones are ignored */
+    lisp_object_t padded[NATIVE_MAX_ARITY];
+    if (nargs < arity) {
+        for (int i = 0; i < arity; i++)
+            padded[i] = i < nargs ? args[i] : NIL;
+        args = padded;
+    }
     switch (arity) {
     case 0:
         return ((lisp_object_t(*)())fp)();
     case 1:
-        return ((lisp_object_t(*)(lisp_object_t))fp)(car(x));
+        return ((lisp_object_t(*)(lisp_object_t))fp)(args[0]);
     case 2:
-        return ((lisp_object_t(*)(lisp_object_t, lisp_object_t))fp)(car(x), cadr(x));
+        return ((lisp_object_t(*)(lisp_object_t, lisp_object_t))fp)(args[0], args[1]);
     case 3:
-        return ((lisp_object_t(*)(lisp_object_t, lisp_object_t, lisp_object_t))fp)(car(x), cadr(x), caddr(x));
-    case FUNCALL_ARITY:
-        return ((lisp_object_t(*)(lisp_object_t, lisp_object_t, lisp_object_t))fp)(car(x), cdr(x), a);
+        return ((lisp_object_t(*)(lisp_object_t, lisp_object_t, lisp_object_t))fp)(args[0], args[1], args[2]);
+    case 4:
+        return ((lisp_object_t(*)(lisp_object_t, lisp_object_t, lisp_object_t, lisp_object_t))fp)(args[0], args[1], args[2], args[3]);
+    case 5:
+        return ((lisp_object_t(*)(lisp_object_t, lisp_object_t, lisp_object_t, lisp_object_t, lisp_object_t))fp)(args[0], args[1], args[2], args[3], args[4]);
+    case 6:
+        return ((lisp_object_t(*)(lisp_object_t, lisp_object_t, lisp_object_t, lisp_object_t, lisp_object_t, lisp_object_t))fp)(args[0], args[1], args[2], args[3], args[4], args[5]);
     default:
         abort();
     }
 }
 
+static lisp_object_t apply_built_in_function(lisp_object_t fn, lisp_object_t x, lisp_object_t a)
+{
+    size_t base = interp->vm_sp;
+    for (; x != NIL; x = cdr(x)) {
+        if (interp->vm_sp == VM_STACK_SIZE)
+            return raise_condition("stack-overflow", NIL);
+        interp->vm_stack[interp->vm_sp++] = car(x);
+    }
+    lisp_object_t result = call_native_function(fn, interp->vm_sp - base, interp->vm_stack + base, a);
+    interp->vm_sp = base;
+    return result;
+}
+
 lisp_object_t apply(lisp_object_t fn, lisp_object_t x, lisp_object_t a)
 {
     if (atom(fn) != NIL) {
         if (fn == NIL) {
-            return raise(sym("illegal-function-call"), fn);
+            return raise_condition("illegal-function-call", fn);
         }
         if (symbolp(fn) != NIL) {
             // Check whether it is s symbol with function binding
@@ -1463,24 +2475,26 @@ lisp_object_t apply(lisp_object_t fn, lisp_object_t x, lisp_object_t a)
             if (symptr->function != NIL) {
                 fn = symptr->function;
             } else {
-                return raise(sym("illegal-function-call"), fn);
+                return raise_condition("illegal-function-call", fn);
             }
         } else if (functionp(fn) == NIL) {
-            return raise(sym("illegal-function-call"), fn);
+            return raise_condition("illegal-function-call", fn);
         }
         struct lisp_function *fnptr = LispFunctionPtr(fn);
         if (fnptr->actual_function != NIL) {
-            if (fnptr->kind == interp->syms.lambda)
-                return apply_lambda(fnptr->actual_function, x, a);
+            if (fnptr->kind == interp->syms.compiled_function)
+                return apply_compiled_function(fn, x, a);
+            else if (fnptr->kind == interp->syms.lambda)
+                return apply_lambda(fn, x, a);
             else if (fnptr->kind == interp->syms.built_in_function)
-                return apply_built_in_function(fnptr->actual_function, x, a);
+                return apply_built_in_function(fn, x, a);
             else
                 abort();
         } else {
             abort();
         }
     } else {
-        return raise(sym("illegal-function-call"), fn);
+        return raise_condition("illegal-function-call", fn);
     }
 }
 
@@ -1488,40 +2502,50 @@ lisp_object_t evlis(lisp_object_t m, lisp_object_t a)
 {
     if (null(m) != NIL)
         return NIL;
-    else
-        return cons(eval(car(m), a), evlis(cdr(m), a));
+    GC_PROTECT(m);
+    GC_PROTECT(a);
+    lisp_object_t first = eval(car(m), a);
+    GC_PROTECT(first);
+    lisp_object_t rest = evlis(cdr(m), a);
+    return cons(first, rest);
 }
 
-lisp_object_t eval_if(lisp_object_t e, lisp_object_t a)
+/* The helpers below for forms that have a tail position evaluate
+ * everything except that position, and leave it to the loop in eval() */
+static lisp_object_t eval_if(lisp_object_t e, lisp_object_t a)
 {
-    lisp_object_t test_form = cadr(e);
-    lisp_object_t then_form = caddr(e);
-    lisp_object_t else_form = cadr(cddr(e));
-    if (eval(test_form, a) != NIL)
-        return eval(then_form, a);
-    else if (else_form != NIL)
-        return eval(else_form, a);
+    GC_PROTECT(e);
+    if (eval(cadr(e), a) != NIL)
+        return caddr(e);
     else
-        return NIL;
+        return cadr(cddr(e));
 }
 
-lisp_object_t evallet(lisp_object_t e, lisp_object_t a)
+static lisp_object_t evallet(lisp_object_t e, lisp_object_t a)
 {
+    GC_PROTECT(a);
     lisp_object_t extended_env = a;
-    for (lisp_object_t varlist = car(e); varlist != NIL; varlist = cdr(varlist)) {
-        lisp_object_t entry = car(varlist);
-        if (consp(entry) != NIL)
-            extended_env = cons(cons(car(entry), eval(cadr(entry), a)), extended_env);
-        else
-            extended_env = cons(cons(entry, NIL), extended_env);
+    GC_PROTECT(extended_env);
+    lisp_object_t varlist = car(e);
+    GC_PROTECT(varlist);
+    for (; varlist != NIL; varlist = cdr(varlist)) {
+        lisp_object_t binding;
+        if (consp(car(varlist)) != NIL) {
+            lisp_object_t value = eval(cadar(varlist), a);
+            binding = cons(caar(varlist), value);
+        } else {
+            binding = cons(car(varlist), NIL);
+        }
+        extended_env = cons(binding, extended_env);
     }
-    return eval(cons(interp->syms.progn, cdr(e)), extended_env);
+    return extended_env;
 }
 
 lisp_object_t set_symbol_value(lisp_object_t symbol, lisp_object_t value)
 {
     struct symbol *sym = SymbolPtr(symbol);
     sym->value = value;
+    write_barrier(&sym->value, value);
     return value;
 }
 
@@ -1531,45 +2555,149 @@ lisp_object_t symbol_value(lisp_object_t symbol)
     return sym->value;
 }
 
+lisp_object_t proclaim_special(lisp_object_t symbol)
+{
+    check_symbol(symbol);
+    SymbolPtr(symbol)->flags |= SYMBOL_SPECIAL;
+    write_barrier_bytes(&SymbolPtr(symbol)->flags, sizeof(uint32_t));
+    return symbol;
+}
+
+lisp_object_t proclaim_constant(lisp_object_t symbol, lisp_object_t value)
+{
+    check_symbol(symbol);
+    SymbolPtr(symbol)->value = value;
+    write_barrier(&SymbolPtr(symbol)->value, value);
+    SymbolPtr(symbol)->flags |= SYMBOL_SPECIAL | SYMBOL_CONSTANT;
+    write_barrier_bytes(&SymbolPtr(symbol)->flags, sizeof(uint32_t));
+    return symbol;
+}
+
+/* Redefining a function recompiles the definitions that inlined it
+ * and are still current (see optimize_definition() in compile.c) */
+static void install_function(lisp_object_t symbol, lisp_object_t function, lisp_object_t expansion)
+{
+    GC_PROTECT(symbol);
+    SymbolPtr(symbol)->function = function;
+    write_barrier(&SymbolPtr(symbol)->function, function);
+    interp->function_epoch++;
+    if (expansion != NIL || getprop(symbol, interp->syms.inline_expansion) != NIL)
+        putprop(symbol, interp->syms.inline_expansion, expansion);
+    /* The two-argument case of the new definition may differ */
+    if (getprop(symbol, interp->syms.two_arg_function) != NIL)
+        putprop(symbol, interp->syms.two_arg_function, NIL);
+    lisp_object_t callers = getprop(symbol, interp->syms.inline_callers);
+    if (callers == NIL)
+        return;
+    GC_PROTECT(callers);
+    putprop(symbol, interp->syms.inline_callers, NIL);
+    for (; callers != NIL; callers = cdr(callers)) {
+        lisp_object_t caller = car(callers);
+        if (getprop(caller, interp->syms.inline_function) == SymbolPtr(caller)->function)
+            eval_toplevel(getprop(caller, interp->syms.inline_source));
+    }
+}
+
 lisp_object_t set_symbol_function(lisp_object_t symbol, lisp_object_t function)
 {
-    struct symbol *sym = SymbolPtr(symbol);
-    sym->function = function;
+    check_symbol(symbol);
+    install_function(symbol, function, NIL);
     return symbol;
 }
 
-lisp_object_t eval_function(lisp_object_t function, lisp_object_t a);
+/* What a definition compiled by the optimizer calls instead of
+ * set-symbol-function.  Expansion is the inline expansion of the
+ * function, if it has one, and inlined lists the functions whose
+ * expansions it uses, each of which gets the symbol added to its
+ * callers so that it can recompile definition when it changes. */
+lisp_object_t define_function(lisp_object_t symbol, lisp_object_t function, lisp_object_t expansion, lisp_object_t inlined, lisp_object_t definition)
+{
+    check_symbol(symbol);
+    GC_PROTECT(symbol);
+    GC_PROTECT(function);
+    GC_PROTECT(expansion);
+    GC_PROTECT(inlined);
+    GC_PROTECT(definition);
+    for (; inlined != NIL; inlined = cdr(inlined)) {
+        lisp_object_t callers = getprop(car(inlined), interp->syms.inline_callers);
+        lisp_object_t x = callers;
+        while (x != NIL && car(x) != symbol)
+            x = cdr(x);
+        if (x == NIL) {
+            callers = cons(symbol, callers);
+            putprop(car(inlined), interp->syms.inline_callers, callers);
+        }
+    }
+    putprop(symbol, interp->syms.inline_source, definition);
+    putprop(symbol, interp->syms.inline_function, function);
+    install_function(symbol, function, expansion);
+    return symbol;
+}
 
 lisp_object_t evalset(lisp_object_t e, lisp_object_t a)
 {
+    GC_PROTECT(e);
+    GC_PROTECT(a);
     lisp_object_t symbol = eval(cadr(e), a);
-    check_symbol(symbol);
+    GC_PROTECT(symbol);
     lisp_object_t new_value = eval(caddr(e), a);
-    lisp_object_t x = assoc(symbol, a);
-    if (x == NIL) {
-        if (getprop(symbol, sym("param")) == T)
+    return assign_variable(symbol, new_value, a);
+}
+
+/* The environment is a chain of frames (see make_frame) and single
+ * (variable . value) bindings.  The pointer returned is only good until
+ * the next allocation. */
+static lisp_object_t *find_binding(lisp_object_t var, lisp_object_t a)
+{
+    while (a != NIL) {
+        if (vectorp(a) != NIL) {
+            lisp_object_t *slots = VectorStorage(a);
+            lisp_object_t *value = slots + FRAME_FIRST_SLOT;
+            for (lisp_object_t x = slots[FRAME_VARIABLES]; x != NIL; x = cdr(x), value++)
+                if (car(x) == var)
+                    return value;
+            a = slots[FRAME_PARENT];
+        } else {
+            if (caar(a) == var)
+                return &ConsPtr(car(a))->cdr;
+            a = cdr(a);
+        }
+    }
+    return NULL;
+}
+
+lisp_object_t assign_variable(lisp_object_t symbol, lisp_object_t new_value, lisp_object_t a)
+{
+    check_symbol(symbol);
+    lisp_object_t *binding = find_binding(symbol, a);
+    if (binding == NULL) {
+        if (SymbolIsSpecial(symbol))
             return set_symbol_value(symbol, new_value);
         else
             abort();
     } else {
-        rplacd(x, new_value);
+        *binding = new_value;
+        write_barrier(binding, new_value);
         return new_value;
     }
 }
 
-lisp_object_t evalprogn(lisp_object_t e, lisp_object_t a)
+static lisp_object_t evalprogn(lisp_object_t e, lisp_object_t a)
 {
-    lisp_object_t return_value = NIL;
-    for (lisp_object_t o = e; o != NIL; o = cdr(o))
-        return_value = eval(car(o), a);
-    return return_value;
+    if (e == NIL)
+        return NIL;
+    GC_PROTECT(e);
+    GC_PROTECT(a);
+    for (; cdr(e) != NIL; e = cdr(e))
+        eval(car(e), a);
+    return car(e);
 }
 
 lisp_object_t evalblock(lisp_object_t e, lisp_object_t a)
 {
     lisp_object_t block_number = car(e);
     push_return_context(block_number);
-    if (setjmp(interp->return_stack->buf)) {
+    if (__builtin_setjmp(interp->return_stack->buf)) {
         return pop_return_context();
     } else {
         // This is a single form in current approach
@@ -1580,70 +2708,94 @@ lisp_object_t evalblock(lisp_object_t e, lisp_object_t a)
     }
 }
 
-lisp_object_t evaltagbody(lisp_object_t e, lisp_object_t a)
+/* Turns the body of a tagbody into (%tagbody forms alist), where forms
+ * is a vector of the forms that are not tags and the alist maps each
+ * tag to the index of the form that follows it */
+lisp_object_t lower_tagbody(lisp_object_t body)
 {
     /* count forms that are not tags */
     int n = 0;
-    for (lisp_object_t x = e; x != NIL; x = cdr(x)) {
+    for (lisp_object_t x = body; x != NIL; x = cdr(x)) {
         if (symbolp(car(x)) == NIL)
             n++;
     }
-    push_return_context(interp->syms.tagbody);
-    /* forms in an array */
-    lisp_object_t *table = malloc(n * sizeof(lisp_object_t));
+    lisp_object_t x = body;
+    GC_PROTECT(x);
+    lisp_object_t table = allocate_vector(n << 4);
+    GC_PROTECT(table);
     int i = 0;
-    /* alist tag -> array index */
     lisp_object_t alist = NIL;
-    for (lisp_object_t x = e; x != NIL; x = cdr(x)) {
-        if (symbolp(car(x)) == NIL)
-            /* not a symbol - add form to table */
-            table[i++] = car(x);
-        else
-            /* add symbol -> table index mapping to alist */
-            alist = cons(cons(car(x), i), alist);
+    GC_PROTECT(alist);
+    for (; x != NIL; x = cdr(x)) {
+        if (symbolp(car(x)) == NIL) {
+            /* The table may have been promoted by now */
+            VectorStorage(table)[i] = car(x);
+            write_barrier(&VectorStorage(table)[i++], car(x));
+        } else {
+            lisp_object_t entry = cons(car(x), i << 4);
+            alist = cons(entry, alist);
+        }
     }
-    interp->return_stack->tagbody_forms_len = i;
-    interp->return_stack->tagbody_forms = table;
+    return List(interp->syms.pcttagbody, table, alist);
+}
+
+static lisp_object_t eval_lowered_tagbody(lisp_object_t table, lisp_object_t alist, lisp_object_t a)
+{
+    GC_PROTECT(table);
+    GC_PROTECT(a);
+    size_t n = VectorPtr(table)->len >> 4;
+    push_return_context(interp->syms.tagbody);
     interp->return_stack->return_value = alist;
-    for (i = 0; i < n; i++) {
-        int v = setjmp(interp->return_stack->buf);
-        if (v != 0)
-            i = v - 1;
-        eval(table[i], a);
-    }
+    size_t i = 0;
+    if (__builtin_setjmp(interp->return_stack->buf))
+        i = interp->return_stack->vm_pc; /* set by evalgo() */
+    for (; i < n; i++)
+        eval(VectorStorage(table)[i], a);
     pop_return_context();
     return NIL;
 }
 
+lisp_object_t evaltagbody(lisp_object_t e, lisp_object_t a)
+{
+    GC_PROTECT(a);
+    lisp_object_t lowered = lower_tagbody(e);
+    return eval_lowered_tagbody(cadr(lowered), caddr(lowered), a);
+}
+
+/* The alist of a tagbody context maps tags to the index of the form
+ * (or, for the VM, the bytecode offset) to resume at */
 lisp_object_t evalgo(lisp_object_t tag)
 {
-    while (interp->return_stack && eq(interp->return_stack->type, interp->syms.tagbody) == NIL)
+    while (interp->return_stack && (eq(interp->return_stack->type, interp->syms.tagbody) == NIL || assoc(tag, interp->return_stack->return_value) == NIL))
         pop_return_context();
     struct return_context *ctxt = interp->return_stack;
-    if (ctxt && eq(ctxt->type, interp->syms.tagbody) != NIL) {
-        longjmp(ctxt->buf, cdr(assoc(tag, ctxt->return_value)) + 1);
+    if (ctxt) {
+        int index = cdr(assoc(tag, ctxt->return_value)) >> 4;
+        ctxt->vm_pc = index;
+        interp->vm_sp = ctxt->vm_sp;
+        interp->shadow_sp = ctxt->shadow_sp;
+        __builtin_longjmp(ctxt->buf, 1);
     } else {
-        raise(sym("error"), NIL);
+        raise_condition("error", NIL);
     }
     return NIL; /* never actually returned */
 }
 
 lisp_object_t eval_condition_case(lisp_object_t e, lisp_object_t a)
 {
-    lisp_object_t var = car(e);
-    lisp_object_t code = cadr(e);
-    lisp_object_t handlers = cddr(e);
-    for (lisp_object_t handler = handlers; handler != NIL; handler = cdr(handler)) {
-        lisp_object_t symbol = caar(handler);
-        push_return_context(symbol);
-        if (setjmp(interp->return_stack->buf)) {
-            symbol = interp->return_stack->type;
-            lisp_object_t entry = cons(var, cons(symbol, pop_return_context()));
-            lisp_object_t env = cons(entry, a);
-            return eval(cadr(assoc(symbol, handlers)), env);
-        }
+    GC_PROTECT(e);
+    GC_PROTECT(a);
+    push_condition_case_context(cddr(e));
+    if (__builtin_setjmp(interp->return_stack->buf)) {
+        lisp_object_t condition = pop_return_context();
+        GC_PROTECT(condition);
+        lisp_object_t binding = cons(car(e), condition);
+        lisp_object_t env = cons(binding, a);
+        return eval(cadr(assoc(car(condition), cddr(e))), env);
     }
-    return eval(code, a);
+    lisp_object_t result = eval(cadr(e), a);
+    pop_return_context();
+    return result;
 }
 
 lisp_object_t eval_function(lisp_object_t function, lisp_object_t a)
@@ -1653,12 +2805,16 @@ lisp_object_t eval_function(lisp_object_t function, lisp_object_t a)
         if (symptr->function != NIL)
             return symptr->function;
         else
-            return raise(sym("undefined-function"), function);
+            return raise_condition("undefined-function", function);
     } else {
+        GC_PROTECT(function);
+        lisp_object_t lambda_list = parse_lambda_list(cadr(function));
+        GC_PROTECT(lambda_list);
         lisp_object_t fn = allocate_function();
         struct lisp_function *fnptr = LispFunctionPtr(fn);
         fnptr->kind = interp->syms.lambda;
         fnptr->actual_function = function;
+        fnptr->arguments = lambda_list;
         return fn;
     }
 }
@@ -1670,48 +2826,65 @@ lisp_object_t eval_quasiquote(lisp_object_t e, lisp_object_t a, int depth)
     } else if (atom(e) != NIL) {
         return e;
     } else if (consp(e) != NIL) {
+        GC_PROTECT(e);
+        GC_PROTECT(a);
         if (eq(car(e), interp->syms.quasiquote) != NIL) {
-            return cons(interp->syms.quasiquote, cons(eval_quasiquote(cadr(e), a, depth + 1), NIL));
+            lisp_object_t x = eval_quasiquote(cadr(e), a, depth + 1);
+            return List(interp->syms.quasiquote, x);
         } else if (eq(car(e), interp->syms.unquote) != NIL) {
             if (depth == 0)
                 return eval(cadr(e), a);
-            else
-                return cons(interp->syms.unquote, cons(eval_quasiquote(cadr(e), a, depth - 1), NIL));
+            lisp_object_t x = eval_quasiquote(cadr(e), a, depth - 1);
+            return List(interp->syms.unquote, x);
         } else if (eq(car(e), interp->syms.unquote_splice) != NIL) {
             abort();
         } else if (consp(car(e)) != NIL && eq(car(car(e)), interp->syms.unquote_splice) != NIL) {
             if (depth == 0) {
-                lisp_object_t result = eval(cadr(car(e)), a);
-                lisp_object_t last_pair;
-                for (last_pair = result; cdr(last_pair) != NIL; last_pair = cdr(last_pair))
-                    ;
-                rplacd(last_pair, eval_quasiquote(cdr(e), a, depth));
-                return result;
+                lisp_object_t spliced = eval(cadr(car(e)), a);
+                GC_PROTECT(spliced);
+                lisp_object_t rest = eval_quasiquote(cdr(e), a, depth);
+                return append(spliced, rest);
             } else {
-                return cons(cons(interp->syms.unquote_splice, cons(eval_quasiquote(cadar(e), a, depth - 1), NIL)), NIL);
+                lisp_object_t x = eval_quasiquote(cadar(e), a, depth - 1);
+                lisp_object_t splice = List(interp->syms.unquote_splice, x);
+                return cons(splice, NIL);
             }
         } else {
-            return cons(eval_quasiquote(car(e), a, depth), eval_quasiquote(cdr(e), a, depth));
+            lisp_object_t first = eval_quasiquote(car(e), a, depth);
+            GC_PROTECT(first);
+            lisp_object_t rest = eval_quasiquote(cdr(e), a, depth);
+            return cons(first, rest);
         }
     }
     abort();
     return NIL;
 }
 
-static lisp_object_t quote_list(lisp_object_t list)
-{
-    if (list == NIL)
-        return NIL;
-    else
-        return cons(cons(interp->syms.quote, cons(car(list), NIL)), quote_list(cdr(list)));
-}
-
 /* This returns a pair as we don't have multiple value return */
 /* First element is the macroexpansion, second indicates whether expansion happened */
+/* The macro function is applied straight to the unevaluated arguments.
+ * Expanding the same cons again (e.g. evaluating the same form over
+ * and over) finds the expansion in the cache, unless a function has
+ * been redefined or a symbol made a macro since */
 lisp_object_t macroexpand1(lisp_object_t e, lisp_object_t a)
 {
     if (consp(e) != NIL && symbolp(car(e)) != NIL && getprop(car(e), interp->syms.macro) != NIL) {
-        return cons(eval(cons(car(e), quote_list(cdr(e))), a), T);
+        struct macro_cache_entry *entry = &interp->macro_cache[ConsPtr(e)->id % MACRO_CACHE_SIZE];
+        if (ConsPtr(e)->id != 0 && entry->form == e && entry->function_epoch == interp->function_epoch)
+            return cons(entry->expansion, T);
+        GC_PROTECT(e);
+        lisp_object_t expansion = apply(SymbolPtr(car(e))->function, cdr(e), a);
+        GC_PROTECT(expansion);
+        /* The call may have collected garbage and moved e */
+        if (ConsPtr(e)->id == 0) {
+            ConsPtr(e)->id = interp->next_cons_id++;
+            write_barrier_bytes(&ConsPtr(e)->id, sizeof(uint64_t));
+        }
+        entry = &interp->macro_cache[ConsPtr(e)->id % MACRO_CACHE_SIZE];
+        entry->form = e;
+        entry->expansion = expansion;
+        entry->function_epoch = interp->function_epoch;
+        return cons(expansion, T);
     } else {
         return cons(e, NIL);
     }
@@ -1719,61 +2892,70 @@ lisp_object_t macroexpand1(lisp_object_t e, lisp_object_t a)
 
 lisp_object_t macroexpand(lisp_object_t e, lisp_object_t a)
 {
-    lisp_object_t expanded = NIL;
-    do {
-        lisp_object_t return_values = macroexpand1(e, a);
-        e = car(return_values);
-        expanded = cdr(return_values);
-    } while (expanded != NIL);
+    /* Most forms are not macro calls, and checking for that here saves
+     * consing the return values of macroexpand1() */
+    GC_PROTECT(a);
+    while (consp(e) != NIL && symbolp(car(e)) != NIL && getprop(car(e), interp->syms.macro) != NIL)
+        e = car(macroexpand1(e, a));
     return e;
 }
 
 lisp_object_t macroexpand_all(lisp_object_t e);
 
+/* These return the original conses wherever nothing inside them was
+ * a macro call, so expanding code that has no macros allocates nothing */
 static lisp_object_t macroexpand_all_list(lisp_object_t list)
 {
-    if (list == NIL)
-        return NIL;
-    else
-        return cons(macroexpand_all(car(list)), macroexpand_all_list(cdr(list)));
+    if (consp(list) == NIL)
+        return list;
+    GC_PROTECT(list);
+    lisp_object_t first = macroexpand_all(car(list));
+    GC_PROTECT(first);
+    lisp_object_t rest = macroexpand_all_list(cdr(list));
+    return cons_if_changed(list, first, rest);
 }
 
 static lisp_object_t macroexpand_all_tagbody(lisp_object_t tagbody)
 {
-    if (tagbody == NIL) {
+    if (tagbody == NIL)
         return NIL;
-    } else if (consp(car(tagbody)) != NIL) { /* not a tag */
-        return cons(macroexpand_all(car(tagbody)), macroexpand_all_tagbody(cdr(tagbody)));
-    } else {
-        return cons(car(tagbody), macroexpand_all_tagbody(cdr(tagbody)));
-    }
-    return NIL;
+    GC_PROTECT(tagbody);
+    lisp_object_t first = car(tagbody);
+    GC_PROTECT(first);
+    if (consp(first) != NIL) /* not a tag */
+        first = macroexpand_all(first);
+    lisp_object_t rest = macroexpand_all_tagbody(cdr(tagbody));
+    return cons_if_changed(tagbody, first, rest);
 }
 
 static lisp_object_t macroexpand_all_let(lisp_object_t vars)
 {
-    if (vars == NIL) {
+    if (vars == NIL)
         return NIL;
-    } else {
-        lisp_object_t clause = car(vars);
-        if (consp(clause) != NIL) {
-            lisp_object_t var = car(clause);
-            lisp_object_t val = cadr(clause);
-            return cons(cons(var, cons(macroexpand_all(val), NIL)), macroexpand_all_let(cdr(vars)));
-        } else {
-            return cons(clause, macroexpand_all_let(cdr(vars)));
-        }
+    GC_PROTECT(vars);
+    lisp_object_t clause = car(vars);
+    GC_PROTECT(clause);
+    if (consp(clause) != NIL) {
+        lisp_object_t forms = macroexpand_all_list(cdr(clause));
+        clause = cons_if_changed(clause, car(clause), forms);
     }
+    lisp_object_t rest = macroexpand_all_let(cdr(vars));
+    return cons_if_changed(vars, clause, rest);
 }
 
 static lisp_object_t macroexpand_all_quasiquote(lisp_object_t e)
 {
     if (atom(e) != NIL)
         return e;
-    else if (car(e) == interp->syms.unquote || car(e) == interp->syms.unquote_splice)
-        return cons(car(e), cons(macroexpand_all(cadr(e)), NIL));
-    else
-        return cons(car(e), cons(macroexpand_all_quasiquote(cadr(e)), NIL));
+    GC_PROTECT(e);
+    if (car(e) == interp->syms.unquote || car(e) == interp->syms.unquote_splice) {
+        lisp_object_t forms = macroexpand_all_list(cdr(e));
+        return cons_if_changed(e, car(e), forms);
+    }
+    lisp_object_t first = macroexpand_all_quasiquote(car(e));
+    GC_PROTECT(first);
+    lisp_object_t rest = macroexpand_all_quasiquote(cdr(e));
+    return cons_if_changed(e, first, rest);
 }
 
 lisp_object_t macroexpand_all(lisp_object_t e)
@@ -1782,122 +2964,181 @@ lisp_object_t macroexpand_all(lisp_object_t e)
     if (consp(e) == NIL) {
         return e;
     } else if (symbolp(car(e)) != NIL) {
-        lisp_object_t s = car(e);
-        if (s == interp->syms.if_) {
-            lisp_object_t test_form = cadr(e);
-            lisp_object_t then_form = caddr(e);
-            lisp_object_t else_form = cadr(cddr(e));
-            return List(interp->syms.if_, macroexpand_all(test_form), macroexpand_all(then_form), macroexpand_all(else_form));
-        } else if (s == interp->syms.tagbody) {
-            return cons(s, macroexpand_all_tagbody(cdr(e)));
-        } else if (s == interp->syms.progn) {
-            return cons(s, macroexpand_all_list(cdr(e)));
-        } else if (s == interp->syms.condition_case) {
-            lisp_object_t exc = cadr(e);
-            lisp_object_t body = caddr(e);
-            lisp_object_t clauses = cdr(cddr(e));
-            return cons(s, cons(exc, cons(macroexpand_all(body), macroexpand_all_let(clauses))));
-        } else if (s == interp->syms.let) {
-            lisp_object_t body = cddr(e);
-            return cons(s, cons(macroexpand_all_let(cadr(e)), macroexpand_all_list(body)));
-        } else if (s == interp->syms.quote) {
+        GC_PROTECT(e);
+        /* The operator is looked at again after expanding the rest, as
+         * that may move it */
+        switch (SymbolSpecialForm(car(e))) {
+        case SPECIAL_FORM_TAGBODY: {
+            lisp_object_t body = macroexpand_all_tagbody(cdr(e));
+            return cons_if_changed(e, car(e), body);
+        }
+        case SPECIAL_FORM_CONDITION_CASE: {
+            lisp_object_t body = macroexpand_all(caddr(e));
+            GC_PROTECT(body);
+            lisp_object_t clauses = macroexpand_all_let(cdr(cddr(e)));
+            GC_PROTECT(clauses);
+            lisp_object_t rest = cons_if_changed(cddr(e), body, clauses);
+            rest = cons_if_changed(cdr(e), cadr(e), rest);
+            return cons_if_changed(e, car(e), rest);
+        }
+        case SPECIAL_FORM_LET: {
+            lisp_object_t vars = macroexpand_all_let(cadr(e));
+            GC_PROTECT(vars);
+            lisp_object_t body = macroexpand_all_list(cddr(e));
+            lisp_object_t rest = cons_if_changed(cdr(e), vars, body);
+            return cons_if_changed(e, car(e), rest);
+        }
+        case SPECIAL_FORM_QUOTE:
+        case SPECIAL_FORM_DECLARE:
             return e;
-        } else if (s == interp->syms.quasiquote) {
-            return cons(s, macroexpand_all_quasiquote(cdr(e)));
-        } else if (s == interp->syms.function) {
+        case SPECIAL_FORM_QUASIQUOTE: {
+            lisp_object_t rest = macroexpand_all_quasiquote(cdr(e));
+            return cons_if_changed(e, car(e), rest);
+        }
+        case SPECIAL_FORM_FUNCTION:
             if (symbolp(cadr(e)) != NIL) {
                 return e;
             } else if (consp(cadr(e)) != NIL && car(cadr(e)) == interp->syms.lambda) {
+                lisp_object_t body = macroexpand_all_list(cddr(cadr(e)));
+                GC_PROTECT(body);
                 lisp_object_t lambda_expr = cadr(e);
-                lisp_object_t arglist = cadr(lambda_expr);
-                lisp_object_t body = cddr(lambda_expr);
-                return List(s, cons(interp->syms.lambda, cons(arglist, macroexpand_all_list(body))));
+                GC_PROTECT(lambda_expr);
+                lisp_object_t rest = cons_if_changed(cdr(lambda_expr), cadr(lambda_expr), body);
+                lambda_expr = cons_if_changed(lambda_expr, car(lambda_expr), rest);
+                rest = cons_if_changed(cdr(e), lambda_expr, cddr(e));
+                return cons_if_changed(e, car(e), rest);
             } else {
-                return raise(sym("bad-function"), cadr(e));
+                return raise_condition("bad-function", cadr(e));
             }
-        } else {
-            // This covers function calls, but also special forms that look like them,
-            // e.g. `go`, `set`.
-            return cons(car(e), macroexpand_all_list(cdr(e)));
+        default: {
+            // This covers function calls, if and progn, but also special
+            // forms that look like them, e.g. `go`, `set`.
+            lisp_object_t rest = macroexpand_all_list(cdr(e));
+            return cons_if_changed(e, car(e), rest);
+        }
         }
     } else {
         return macroexpand_all_list(e);
     }
 }
 
-lisp_object_t eval_function_call(lisp_object_t e, lisp_object_t a)
+/* Calls to interpreted functions are left to eval() so that their
+ * bodies can be entered without recursing */
+static lisp_object_t eval_function_call(lisp_object_t e, lisp_object_t a, lisp_object_t *args)
 {
     lisp_object_t fn = car(e);
     if (symbolp(fn) != NIL) {
         struct symbol *s = SymbolPtr(fn);
         if (s->function != NIL) {
-            return apply(eval_function(car(e), a), evlis(cdr(e), a), a);
+            lisp_object_t function = eval_function(car(e), a);
+            GC_PROTECT(function);
+            *args = evlis(cdr(e), a);
+            return function;
         } else {
-            return raise(sym("undefined-function"), fn);
+            return raise_condition("undefined-function", fn);
         }
     } else {
-        return raise(sym("illegal-function-call"), fn);
+        return raise_condition("illegal-function-call", fn);
     }
 }
 
+/* Forms in tail position (the branches of if and the last form of a
+ * progn, let or lambda body) are evaluated by going round the loop
+ * rather than by recursing, so tail calls run in constant C stack */
 lisp_object_t eval(lisp_object_t e, lisp_object_t a)
 {
-    if (e == NIL || e == T || integerp(e) != NIL || vectorp(e) != NIL || stringp(e) != NIL || functionp(e) != NIL)
-        return e;
-    if (atom(e) != NIL) {
-        lisp_object_t x = assoc(e, a);
-        if (x == NIL) {
-            /* Could be a global variable */
-            if (getprop(e, sym("param")) == T)
-                return symbol_value(e);
-            else
-                return raise(sym("unbound-variable"), e);
-        } else {
-            return cdr(x);
-        }
-    } else if (atom(car(e) != NIL)) {
-        if (eq(car(e), interp->syms.quote) != NIL) {
+    GC_PROTECT(e);
+    GC_PROTECT(a);
+    for (;;) {
+        if (e == NIL || e == T || integerp(e) != NIL || vectorp(e) != NIL || stringp(e) != NIL || functionp(e) != NIL)
+            return e;
+        if (atom(e) != NIL)
+            return lookup_variable(e, a);
+        if (symbolp(car(e)) == NIL)
+            return raise_condition("illegal-function-call", car(e));
+        switch (SymbolSpecialForm(car(e))) {
+        case SPECIAL_FORM_QUOTE:
             return car(cdr(e));
-        } else if (eq(car(e), interp->syms.quasiquote) != NIL) {
+        case SPECIAL_FORM_QUASIQUOTE:
             return eval_quasiquote(cadr(e), a, 0);
-        } else if (eq(car(e), interp->syms.unquote) != NIL) {
-            return raise(sym("runtime-error"), sym("comma-not-inside-backquote"));
-        } else if (eq(car(e), interp->syms.if_) != NIL) {
-            return eval_if(e, a);
-        } else if (eq(car(e), interp->syms.let) != NIL) {
-            return evallet(cdr(e), a);
-        } else if (eq(car(e), interp->syms.set) != NIL) {
+        case SPECIAL_FORM_UNQUOTE:
+            return raise_condition("runtime-error", sym("comma-not-inside-backquote"));
+        case SPECIAL_FORM_IF:
+            e = eval_if(e, a);
+            break;
+        case SPECIAL_FORM_LET:
+            a = evallet(cdr(e), a);
+            e = evalprogn(cddr(e), a);
+            break;
+        case SPECIAL_FORM_SET:
             return evalset(e, a);
-        } else if (eq(car(e), interp->syms.progn) != NIL) {
-            return evalprogn(cdr(e), a);
-        } else if (eq(car(e), interp->syms.pctblock) != NIL) {
+        case SPECIAL_FORM_PROGN:
+            e = evalprogn(cdr(e), a);
+            break;
+        case SPECIAL_FORM_PCTBLOCK:
             return evalblock(cdr(e), a);
-        } else if (eq(car(e), interp->syms.tagbody) != NIL) {
+        case SPECIAL_FORM_TAGBODY:
             return evaltagbody(cdr(e), a);
-        } else if (eq(car(e), interp->syms.go) != NIL) {
+        case SPECIAL_FORM_PCTTAGBODY:
+            return eval_lowered_tagbody(cadr(e), caddr(e), a);
+        case SPECIAL_FORM_GO:
             return evalgo(cadr(e));
-        } else if (eq(car(e), interp->syms.condition_case) != NIL) {
+        case SPECIAL_FORM_CONDITION_CASE:
             return eval_condition_case(cdr(e), a);
-        } else if (eq(car(e), interp->syms.function) != NIL) {
+        case SPECIAL_FORM_FUNCTION:
             return eval_function(cadr(e), a);
-        } else {
-            return eval_function_call(e, a);
+        case SPECIAL_FORM_DECLARE:
+            /* Only the bytecode compiler uses declarations */
+            return NIL;
+        default: {
+            /* block and return-from have been compiled away */
+            lisp_object_t args = NIL;
+            lisp_object_t fn = eval_function_call(e, a, &args);
+            GC_PROTECT(fn);
+            if (LispFunctionPtr(fn)->kind != interp->syms.lambda)
+                return apply(fn, args, a);
+            a = make_frame(LispFunctionPtr(fn)->arguments, args, a);
+            e = evalprogn(cddr(LispFunctionPtr(fn)->actual_function), a);
+            break;
+        }
         }
+    }
+}
+
+lisp_object_t lookup_variable(lisp_object_t e, lisp_object_t a)
+{
+    lisp_object_t *binding = find_binding(e, a);
+    if (binding == NULL) {
+        /* Could be a global variable */
+        if (SymbolIsSpecial(e))
+            return symbol_value(e);
+        else
+            return raise_condition("unbound-variable", e);
     } else {
-        return raise(sym("illegal-function-call"), car(e));
+        return *binding;
     }
 }
 
 lisp_object_t evalquote(lisp_object_t fn, lisp_object_t x)
 {
-    return apply(eval_function(fn, NIL), x, NIL);
+    GC_PROTECT(x);
+    lisp_object_t function = eval_function(fn, NIL);
+    return apply(function, x, NIL);
 }
 
 /* Load */
 
+/* Toplevel forms are compiled to bytecode and run on the VM, falling
+ * back to the tree-walking evaluator for anything the bytecode
+ * compiler cannot handle */
 lisp_object_t eval_toplevel(lisp_object_t e)
 {
-    return eval(compile_toplevel(macroexpand_all(e)), NIL);
+    GC_PROTECT(e);
+    lisp_object_t fn = compile_bytecode(e);
+    if (fn != NIL)
+        return apply(fn, NIL, NIL);
+    else
+        return eval(compile_toplevel(e), NIL);
 }
 
 static void load_eval_callback(void *ignored, lisp_object_t obj)
@@ -1970,12 +3211,16 @@ lisp_object_t princ(lisp_object_t obj)
     return obj;
 }
 
+/* The tagged representations of integers can be added, subtracted
+ * and (with one of them untagged) multiplied directly, and overflow
+ * exactly when the integers would */
 lisp_object_t plus(lisp_object_t x, lisp_object_t y)
 {
     check_integer(x);
     check_integer(y);
-    lisp_object_t result = x + y;
-    check_integer(result);
+    int64_t result;
+    if (__builtin_add_overflow((int64_t)x, (int64_t)y, &result))
+        return raise_condition("integer-overflow", List(sym("two-arg-plus"), x, y));
     return result;
 }
 
@@ -1983,8 +3228,9 @@ lisp_object_t minus(lisp_object_t x, lisp_object_t y)
 {
     check_integer(x);
     check_integer(y);
-    lisp_object_t result = x - y;
-    check_integer(result);
+    int64_t result;
+    if (__builtin_sub_overflow((int64_t)x, (int64_t)y, &result))
+        return raise_condition("integer-overflow", List(sym("two-arg-minus"), x, y));
     return result;
 }
 
@@ -1992,10 +3238,9 @@ lisp_object_t times(lisp_object_t x, lisp_object_t y)
 {
     check_integer(x);
     check_integer(y);
-    int64_t xint = x >> 4;
-    int64_t yint = y >> 4;
-    lisp_object_t result = (xint * yint) << 4;
-    check_integer(result);
+    int64_t result;
+    if (__builtin_mul_overflow(((int64_t)x) >> 4, (int64_t)y, &result))
+        return raise_condition("integer-overflow", List(sym("two-arg-times"), x, y));
     return result;
 }
 
@@ -2022,10 +3267,11 @@ lisp_object_t type_of(lisp_object_t obj)
     case VECTOR_TYPE:
         return interp->syms.vector;
     default:
-        if (integerp(obj))
+        if (integerp(obj) != NIL)
             return interp->syms.integer;
-        else
-            abort();
+        else if (functionp(obj) != NIL)
+            return interp->syms.function;
+        return raise_condition("type-error", obj);
     }
 }
 
@@ -2056,7 +3302,8 @@ lisp_object_t save_image(lisp_object_t name)
     gc();
     do_write(fd, (char *)&interp->symbol_table, sizeof(lisp_object_t));
     do_write(fd, (char *)&interp->heap, sizeof(struct lisp_heap));
-    do_write(fd, interp->heap.heap, interp->heap.size_bytes);
+    do_write(fd, (char *)&interp->function_epoch, sizeof(size_t));
+    do_write(fd, interp->heap.from_space, interp->heap.size_bytes / 2);
     close(fd);
     exit(0);
 }
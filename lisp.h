@@ -1,8 +1,8 @@
 #ifndef LISP_H
 #define LISP_H
 
-#include <setjmp.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "string_buffer.h"
@@ -21,6 +21,8 @@ lisp_object_t parse_string(struct text_stream *ts);
 lisp_object_t parse1(struct text_stream *ts);
 void parse(struct text_stream *ts, void (*callback)(void *, lisp_object_t), void *callback_data);
 lisp_object_t sym(char *string);
+lisp_object_t intern(char *name);
+lisp_object_t find_symbol(char *name);
 char *read_token(struct text_stream *ts);
 
 void init_interpreter(size_t heap_size);
@@ -54,7 +56,6 @@ lisp_object_t load(lisp_object_t filename);
 #define VECTOR_TYPE           0x0000000000000008
 #define FUNCTION_POINTER_TYPE 0x000000000000000A
 #define FUNCTION_TYPE         0x000000000000000C
-#define FORWARDING_POINTER    0x0000000000000001
 // clang-format on
 
 #define ConsPtr(obj) ((struct cons *)((obj) & PTR_MASK))
@@ -68,7 +69,12 @@ lisp_object_t svref(lisp_object_t vector, size_t index);
 lisp_object_t svref_set(lisp_object_t vector, size_t index, lisp_object_t newvalue);
 
 lisp_object_t allocate_string(size_t len, char *str);
+lisp_object_t allocate_blank_string(size_t len);
 lisp_object_t allocate_vector(size_t size);
+lisp_object_t allocate_function();
+lisp_object_t gc();
+lisp_object_t define_native_function(char *symbol_name, void (*function_pointer)(void), int arity, int flags);
+lisp_object_t call_native_function(lisp_object_t fn, int nargs, lisp_object_t *args, lisp_object_t a);
 
 void get_string_parts(lisp_object_t string, size_t *lenptr, char **strptr);
 
@@ -81,6 +87,7 @@ lisp_object_t function_pointer_p(lisp_object_t obj);
 lisp_object_t functionp(lisp_object_t obj);
 lisp_object_t atom(lisp_object_t obj);
 lisp_object_t cons(lisp_object_t car, lisp_object_t cdr);
+lisp_object_t cons_if_changed(lisp_object_t x, lisp_object_t first, lisp_object_t rest);
 lisp_object_t car(lisp_object_t obj);
 lisp_object_t cdr(lisp_object_t obj);
 lisp_object_t caar(lisp_object_t obj);
@@ -109,7 +116,11 @@ lisp_object_t plus(lisp_object_t x, lisp_object_t y);
 lisp_object_t minus(lisp_object_t x, lisp_object_t y);
 lisp_object_t times(lisp_object_t x, lisp_object_t y);
 lisp_object_t divide(lisp_object_t x, lisp_object_t y);
+lisp_object_t greater_than(lisp_object_t o1, lisp_object_t o2);
+lisp_object_t less_than(lisp_object_t o1, lisp_object_t o2);
+void check_integer(int64_t obj);
 lisp_object_t raise(lisp_object_t sym, lisp_object_t value);
+lisp_object_t raise_condition(char *name, lisp_object_t value);
 lisp_object_t getprop(lisp_object_t sym, lisp_object_t ind);
 lisp_object_t putprop(lisp_object_t sym, lisp_object_t ind, lisp_object_t value);
 lisp_object_t macroexpand1(lisp_object_t expr, lisp_object_t env);
@@ -118,13 +129,22 @@ lisp_object_t macroexpand_all(lisp_object_t expr);
 lisp_object_t save_image(lisp_object_t name);
 lisp_object_t type_of(lisp_object_t obj);
 lisp_object_t gensym();
+lisp_object_t make_symbol(lisp_object_t name);
 lisp_object_t compile_toplevel(lisp_object_t expr);
+lisp_object_t set_symbol_value(lisp_object_t symbol, lisp_object_t value);
+lisp_object_t proclaim_special(lisp_object_t symbol);
+lisp_object_t proclaim_constant(lisp_object_t symbol, lisp_object_t value);
+lisp_object_t lookup_variable(lisp_object_t symbol, lisp_object_t a);
+lisp_object_t assign_variable(lisp_object_t symbol, lisp_object_t value, lisp_object_t a);
+lisp_object_t eval_function(lisp_object_t function, lisp_object_t a);
+lisp_object_t lower_tagbody(lisp_object_t body);
+lisp_object_t evalgo(lisp_object_t tag);
 
 struct cons {
     object_header_t header;
     lisp_object_t car;
     lisp_object_t cdr;
-    uint64_t padding;
+    uint64_t id; /* zero until the macro expansion cache needs one */
 };
 
 /* String storage is one of these immediately followed by the
@@ -136,62 +156,274 @@ struct string_header {
     uint64_t padding;
 };
 
+struct vector {
+    object_header_t header;
+    size_t len;
+    size_t size_bytes;
+    uint64_t padding;
+};
+
+/* Vector storage immediately follows the header */
+#define VectorStorage(obj) ((lisp_object_t *)(((char *)VectorPtr(obj)) + sizeof(struct vector)))
+
 struct lisp_function {
     object_header_t header;
     lisp_object_t kind;
     lisp_object_t actual_function;
+    lisp_object_t environment; /* captured frame of a compiled closure */
+    lisp_object_t arguments; /* as returned by parse_lambda_list() */
     uint64_t padding;
 };
 
+/* A built-in function is a function object of kind built-in-function
+ * with this layout.  It takes arity arguments, up to NATIVE_MAX_ARITY
+ * of them, unless it is variadic, in which case it is called as
+ * f(nargs, args, env) with at least arity arguments. */
+struct native_function {
+    object_header_t header;
+    lisp_object_t kind;
+    lisp_object_t entry; /* a function pointer object */
+    lisp_object_t name;
+    lisp_object_t arity;
+    uint64_t flags; /* not a Lisp object */
+};
+
+#define NativeFunctionPtr(obj) ((struct native_function *)((obj) & PTR_MASK))
+
+#define NATIVE_VARIADIC 1
+#define NATIVE_PURE 2 /* no side effects, so calls with constant arguments can be folded */
+#define NATIVE_MAX_ARITY 6
+
+/* A parsed lambda list is (counts . variables), where counts packs the
+ * number of required and &optional parameters and whether there is a
+ * &rest (or &body) parameter into a fixnum */
+#define MAKE_LAMBDA_LIST_COUNTS(required, optional, rest) ((((uint64_t)(required)) | ((uint64_t)(optional) << 16) | ((uint64_t)(rest) << 32)) << 4)
+#define LAMBDA_LIST_REQUIRED(counts) (((counts) >> 4) & 0xffff)
+#define LAMBDA_LIST_OPTIONAL(counts) (((counts) >> 20) & 0xffff)
+#define LAMBDA_LIST_REST(counts) (((counts) >> 36) & 1)
+
+lisp_object_t parse_lambda_list(lisp_object_t lambda_list);
+
+/* An activation frame is a vector holding the enclosing environment,
+ * the names of its variables (for the tree-walker, which looks them up
+ * by name) and then their values */
+#define FRAME_PARENT 0
+#define FRAME_VARIABLES 1
+#define FRAME_FIRST_SLOT 2
+
+lisp_object_t make_frame(lisp_object_t parsed_lambda_list, lisp_object_t args, lisp_object_t parent);
+
 struct symbol {
     object_header_t header;
     lisp_object_t name;
     lisp_object_t value;
     lisp_object_t function;
     lisp_object_t plist;
-    uint64_t padding;
+    /* Not Lisp objects */
+    uint32_t special_form;
+    uint32_t flags;
 };
 
+/* A special variable is a global one (see defparameter), whose value is
+ * in the value cell of its symbol */
+#define SYMBOL_SPECIAL 1
+/* A constant (see defconstant) is a special variable whose value the
+ * compiler may substitute for references to it */
+#define SYMBOL_CONSTANT 2
+
+#define SymbolIsSpecial(obj) (SymbolPtr(obj)->flags & SYMBOL_SPECIAL)
+#define SymbolIsConstant(obj) (SymbolPtr(obj)->flags & SYMBOL_CONSTANT)
+
+/* The index stored in a symbol that names a special form, so that the
+ * evaluator and compilers can dispatch on it with a switch */
+enum special_form {
+    SPECIAL_FORM_NONE,
+    SPECIAL_FORM_QUOTE,
+    SPECIAL_FORM_QUASIQUOTE,
+    SPECIAL_FORM_UNQUOTE,
+    SPECIAL_FORM_IF,
+    SPECIAL_FORM_LET,
+    SPECIAL_FORM_SET,
+    SPECIAL_FORM_PROGN,
+    SPECIAL_FORM_BLOCK,
+    SPECIAL_FORM_PCTBLOCK,
+    SPECIAL_FORM_RETURN_FROM,
+    SPECIAL_FORM_TAGBODY,
+    SPECIAL_FORM_PCTTAGBODY,
+    SPECIAL_FORM_GO,
+    SPECIAL_FORM_CONDITION_CASE,
+    SPECIAL_FORM_FUNCTION,
+    SPECIAL_FORM_DECLARE
+};
+
+#define SymbolSpecialForm(obj) (SymbolPtr(obj)->special_form)
+
 #define LISP_HEAP_BASE 0x400000000000
+/* The address space reserved for each semispace, so that the heap can
+ * grow without moving anything */
+#define LISP_SEMISPACE_RESERVE ((size_t)16 << 30)
 
+enum gc_kind {
+    GC_FULL,
+    GC_MINOR, /* only the nursery */
+    GC_INCREMENTAL /* only from-space, without moving the roots */
+};
+
+/* Counted from the start of the run, or the loading of the image.
+ * Pauses are in microseconds.  A pause lasts from when the mutator
+ * hands over to the collector until it carries on, which may take a
+ * minor collection followed by a slice of an incremental one. */
+struct gc_stats {
+    size_t full_collections;
+    size_t minor_collections;
+    size_t increments;
+    long total_pause;
+    long max_pause;
+    size_t bytes_collected; /* in use in whatever was collected */
+    size_t bytes_copied; /* what survived of that */
+    /* Of from-space and the nursery, in percent of from-space, at the
+     * start and end of the last full collection */
+    int occupancy_before;
+    int occupancy_after;
+};
+
+/* Objects are allocated in a nursery that follows the two semispaces.
+ * A minor collection promotes whatever survives in it to the end of
+ * from-space; a full one copies both into to-space and flips them. */
 struct lisp_heap {
-    size_t size_bytes;
+    size_t size_bytes; /* of the semispaces, not counting the nursery */
     char *heap;
-    char *freeptr;
+    char *freeptr; /* in the nursery, except while collecting */
     /* These are flipped after a GC */
     char *from_space;
     char *to_space;
+    size_t nursery_bytes;
+    char *nursery;
+    char *old_freeptr; /* the end of the objects in from-space */
+    enum gc_kind collecting; /* what gc_copy() is doing */
+    /* A byte for each card of from-space, set by write_barrier() when
+     * a slot in it may refer to the nursery */
+    unsigned char *cards;
+    /* A bit for each 16 bytes of from-space, set where an object starts */
+    unsigned char *object_starts;
+    /* An incremental collection copies from-space into to-space in
+     * slices of at most pause_budget microseconds, while the mutator
+     * goes on using from-space.  Stores made meanwhile are noted in
+     * mutated_cards, and copied over when the collection finishes. */
+    long pause_budget; /* zero to collect everything at once */
+    int cycle_active;
+    char *to_freeptr;
+    char *scanptr;
+    size_t scan_offset; /* into the object at scanptr, when partly scanned */
+    unsigned char *mutated_cards;
+    unsigned char *to_space_object_starts;
+    /* With a pause budget the nursery is kept small enough for a minor
+     * collection to take at most half of it, and incremental collections
+     * are started early enough going by how earlier ones went */
+    size_t nursery_target;
+    size_t promoted_per_minor;
+    size_t scanned_per_slice; /* zero until a slice has been done */
+    char *step_at; /* where in the nursery the next slice is taken */
+    /* When the pause under way started, in microseconds, and how deep
+     * the collector is in it */
+    long pause_start;
+    int pause_depth;
+    /* After a full collection the heap is resized so that what survived
+     * fills about target_occupancy percent of from-space, within
+     * min_bytes and max_bytes (which count both semispaces) */
+    size_t min_bytes;
+    size_t max_bytes;
+    int target_occupancy;
+    struct gc_stats stats;
 };
 
-void *get_rbp(int n);
-
 void lisp_heap_init(struct lisp_heap *heap, size_t bytes);
 void lisp_heap_free(struct lisp_heap *heap);
 void gc_copy(struct lisp_heap *heap, lisp_object_t *p);
+void write_barrier(lisp_object_t *slot, lisp_object_t value);
+void write_barrier_bytes(void *p, size_t len);
+void set_gc_pause(long microseconds);
+void set_heap_limits(size_t min_bytes, size_t max_bytes, int target_occupancy);
+void set_gc_log(FILE *log);
+lisp_object_t gc_statistics();
+
+/* The collector only sees those Lisp objects held by C code that are
+ * in variables registered with GC_PROTECT(), which pushes the address
+ * of the variable onto the shadow stack.  It updates them when it moves
+ * the objects, and each is popped again when its variable goes out of
+ * scope.  Anything else held across a call that may allocate (which
+ * includes the temporaries of nested calls, like the result of the
+ * inner call in cons(eval(x, a), eval(y, a))) may be left pointing at
+ * garbage. */
+#define SHADOW_STACK_SIZE (64 * 1024)
+/* Running out of shadow stack raises stack-overflow while this many
+ * entries are left, which raising it and handling it may use */
+#define SHADOW_STACK_RESERVE 256
+
+lisp_object_t *gc_protect(lisp_object_t *var);
+void gc_unprotect(lisp_object_t **root);
+
+/* var can be any lvalue, such as a field of a struct on the stack */
+#define GC_PROTECT(var) GC_PROTECT_EXPAND(var, __COUNTER__)
+#define GC_PROTECT_EXPAND(var, n) GC_PROTECT_NUMBERED(var, n)
+#define GC_PROTECT_NUMBERED(var, n) lisp_object_t *gc_root_##n __attribute__((cleanup(gc_unprotect))) = gc_protect(&(var))
 
 lisp_object_t list(lisp_object_t first, ...);
 
 #define List(...) list(__VA_ARGS__, VARARGS_LIST_SENTINEL)
 
+/* Return contexts live in an array allocated with the interpreter.
+ * They are entered with __builtin_setjmp(), which only saves the frame
+ * pointer, the stack pointer and where to resume: the function that
+ * calls it keeps everything else on the stack, and raise() and
+ * evalgo() leave with __builtin_longjmp().  That skips the cleanups of
+ * the GC_PROTECT() variables in between, so they restore the shadow
+ * stack pointer too, and variables registered after entering a context
+ * must be out of scope again wherever it resumes. */
 struct return_context {
     lisp_object_t type;
-    jmp_buf buf;
+    void *buf[5];
     lisp_object_t return_value;
-    struct return_context *next;
-    /* tagbody_forms is here so it can be freed in pop_return_context() */
-    /* - it is not actually accessed: */
-    lisp_object_t *tagbody_forms;
-    size_t tagbody_forms_len;
+    size_t shadow_sp;
+    /* Used to resume the VM, or a tagbody, after a non-local exit */
+    size_t vm_sp;
+    size_t vm_pc;
 };
 
+#define RETURN_STACK_SIZE (64 * 1024)
+
+void push_return_context(lisp_object_t type);
+void push_condition_case_context(lisp_object_t clauses);
+lisp_object_t pop_return_context();
+
 #include "syms.h"
 
+/* Expansions of macro calls, found by the id of the call's cons */
+struct macro_cache_entry {
+    lisp_object_t form;
+    lisp_object_t expansion;
+    size_t function_epoch;
+};
+
+#define MACRO_CACHE_SIZE 512
+
 struct lisp_interpreter {
     struct syms syms;
     lisp_object_t symbol_table;
-    struct return_context *return_stack;
+    struct return_context *return_contexts;
+    struct return_context *return_stack; /* the innermost context, or null */
     struct lisp_heap heap;
-    lisp_object_t *top_of_stack;
+    lisp_object_t **shadow_stack;
+    size_t shadow_sp;
+    lisp_object_t *vm_stack;
+    size_t vm_sp;
+    /* Bumped whenever a symbol's function changes, or a symbol becomes
+     * a macro, which invalidates the VM's call caches and the macro
+     * expansion cache */
+    size_t function_epoch;
+    struct macro_cache_entry *macro_cache;
+    uint64_t next_cons_id;
+    FILE *gc_log; /* a line for each collection, or null */
 };
 
 extern struct lisp_interpreter *interp;
@@ -8,12 +8,23 @@
 
 struct interpreter_settings {
     size_t heap_size;
+    /* Zero for the defaults */
+    size_t heap_min;
+    size_t heap_max;
+    int heap_occupancy; /* percent */
+    long gc_pause; /* microseconds */
+    char *gc_log; /* a file name, or "stderr" */
     char *image;
 };
 
 static struct option options[] = {
     { "heap-size", optional_argument, 0, 1 },
     { "image", optional_argument, 0, 2 },
+    { "gc-pause", optional_argument, 0, 3 },
+    { "heap-min", optional_argument, 0, 4 },
+    { "heap-max", optional_argument, 0, 5 },
+    { "heap-occupancy", optional_argument, 0, 6 },
+    { "gc-log", optional_argument, 0, 7 },
     { 0, 0, 0, 0 }
 };
 
@@ -54,9 +65,44 @@ static size_t parse_heap_size(char *arg)
     return heap_size;
 }
 
+static long parse_gc_pause(char *arg)
+{
+    char *endptr;
+    errno = 0;
+    long gc_pause = strtol(arg, &endptr, 10);
+    if (errno) {
+        perror("GC pause");
+        exit(1);
+    } else if (*endptr != '\0' || gc_pause < 0) {
+        printf("Bad GC pause %s\n", arg);
+        exit(1);
+    }
+    return gc_pause;
+}
+
+static int parse_heap_occupancy(char *arg)
+{
+    char *endptr;
+    errno = 0;
+    long occupancy = strtol(arg, &endptr, 10);
+    if (errno) {
+        perror("Heap occupancy");
+        exit(1);
+    } else if (*endptr != '\0' || occupancy < 1 || occupancy > 100) {
+        printf("Bad heap occupancy %s\n", arg);
+        exit(1);
+    }
+    return occupancy;
+}
+
 static int parse_args(int argc, char **argv, struct interpreter_settings *settings)
 {
     settings->heap_size = 1024 * 1024; /* default */
+    settings->heap_min = 0; /* the initial size */
+    settings->heap_max = 0; /* as much as is reserved */
+    settings->heap_occupancy = 0;
+    settings->gc_pause = 0; /* collect everything at once */
+    settings->gc_log = NULL;
     settings->image = NULL;
     int c;
     while (1) {
@@ -76,6 +122,21 @@ static int parse_args(int argc, char **argv, struct interpreter_settings *settin
             settings->image = malloc(strlen(optarg));
             strcpy(settings->image, optarg);
             break;
+        case 3:
+            settings->gc_pause = parse_gc_pause(optarg);
+            break;
+        case 4:
+            settings->heap_min = parse_heap_size(optarg);
+            break;
+        case 5:
+            settings->heap_max = parse_heap_size(optarg);
+            break;
+        case 6:
+            settings->heap_occupancy = parse_heap_occupancy(optarg);
+            break;
+        case 7:
+            settings->gc_log = optarg;
+            break;
         default:
             abort();
         }
@@ -91,9 +152,24 @@ int main(int argc, char **argv)
         init_interpeter_from_image(settings.image);
     else
         init_interpreter(settings.heap_size);
+    set_gc_pause(settings.gc_pause);
+    set_heap_limits(settings.heap_min, settings.heap_max, settings.heap_occupancy);
+    FILE *gc_log = NULL;
+    if (settings.gc_log && !strcmp(settings.gc_log, "stderr")) {
+        gc_log = stderr;
+    } else if (settings.gc_log) {
+        gc_log = fopen(settings.gc_log, "w");
+        if (!gc_log) {
+            perror(settings.gc_log);
+            exit(1);
+        }
+    }
+    set_gc_log(gc_log);
     for (; i < argc; i++)
         load_str(argv[i]);
     free_interpreter();
+    if (gc_log && gc_log != stderr)
+        fclose(gc_log);
     if (settings.image)
         free(settings.image);
     return 0;
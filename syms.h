@@ -18,6 +18,7 @@ struct syms {
     lisp_object_t unquote_splice;
     lisp_object_t let;
     lisp_object_t integer;
+    lisp_object_t fixnum;
     lisp_object_t symbol;
     lisp_object_t cons;
     lisp_object_t string;
@@ -26,8 +27,20 @@ struct syms {
     lisp_object_t function;
     lisp_object_t block;
     lisp_object_t pctblock;
+    lisp_object_t pcttagbody;
     lisp_object_t return_from;
     lisp_object_t if_;
+    lisp_object_t compiled_function;
+    lisp_object_t declare;
+    lisp_object_t list;
+    lisp_object_t append;
+    lisp_object_t raise;
+    lisp_object_t inline_expansion;
+    lisp_object_t inline_callers;
+    lisp_object_t inline_source;
+    lisp_object_t inline_function;
+    lisp_object_t two_arg_function;
+    lisp_object_t define_function;
 };
 
 #endif
@@ -5,6 +5,7 @@
 #include "lisp.h"
 #include "string_buffer.h"
 #include "text_stream.h"
+#include "vm.h"
 
 static char *test_name; /* Global */
 
@@ -366,19 +367,41 @@ static void test_parse_multiple_symbols()
     test_name = "parse_multiple_symbols";
     char *s1 = "foo";
     init_interpreter(32768);
-    interp->symbol_table = NIL;
-    parse1_wrapper(s1);
+    check(find_symbol("foo") == NIL, "not yet interned");
+    lisp_object_t sym1 = parse1_wrapper(s1);
     char *s2 = "bar";
     lisp_object_t sym2 = parse1_wrapper(s2);
-    char *str = print_object(interp->symbol_table);
-    check(strcmp("(bar foo)", str) == 0, "symbol table looks right");
-    free(str);
+    check(find_symbol("foo") == sym1, "symbol table looks right");
+    check(find_symbol("bar") == sym2, "symbol table looks right(2)");
     char *s3 = "bar";
+    char *freeptr = interp->heap.freeptr;
     lisp_object_t sym3 = parse1_wrapper(s3);
     check(eq(sym2, sym3) == T, "symbols eq");
-    str = print_object(interp->symbol_table);
-    check(strcmp("(bar foo)", str) == 0, "symbol table looks right(2)");
-    free(str);
+    check(interp->heap.freeptr == freeptr, "no allocation");
+    free_interpreter();
+}
+
+static void test_symbol_table_growth()
+{
+    test_name = "symbol_table_growth";
+    init_interpreter(1024 * 1024);
+    char name[16];
+    for (int i = 0; i < 2000; i++) {
+        sprintf(name, "s%d", i);
+        intern(name);
+    }
+    gc();
+    int found = 0;
+    for (int i = 0; i < 2000; i++) {
+        sprintf(name, "s%d", i);
+        lisp_object_t symbol = find_symbol(name);
+        char *str = print_object(symbol);
+        found += strcmp(name, str) == 0;
+        free(str);
+    }
+    check(found == 2000, "all found");
+    check(find_symbol("s2000") == NIL, "not found");
+    check(intern("car") == sym("car"), "existing");
     free_interpreter();
 }
 
@@ -1260,7 +1283,7 @@ static void test_lisp_heap_gc_simple()
     char *orig_from_space = interp->heap.from_space;
     char *orig_to_space = interp->heap.to_space;
     check(orig_from_space == interp->heap.heap, "from_space");
-    check(orig_to_space == orig_from_space + interp->heap.size_bytes / 2, "to_space");
+    check(orig_to_space == orig_from_space + LISP_SEMISPACE_RESERVE, "to_space");
     free_interpreter();
 }
 
@@ -1372,6 +1395,7 @@ static void test_gensym()
     char *str = print_object(result);
     check(strcmp("g0", str) == 0, "g0");
     check(symbolp(result) != NIL, "symbol");
+    check(find_symbol("g0") == NIL, "uninterned");
     free(str);
     result = gensym();
     str = print_object(result);
@@ -1382,6 +1406,15 @@ static void test_gensym()
     str = print_object(result);
     check(strcmp("g2", str) == 0, "built-in - g2");
     free(str);
+    result = test_eval_string_helper("(cons (eq (make-symbol \"car\") 'car) (make-symbol \"car\"))");
+    str = print_object(result);
+    check(strcmp("(nil . car)", str) == 0, "make-symbol");
+    free(str);
+    /* Far more than would fit in the heap if they were kept */
+    lisp_object_t count = VectorStorage(interp->symbol_table)[0];
+    for (int i = 0; i < 10000; i++)
+        gensym();
+    check(VectorStorage(interp->symbol_table)[0] == count, "symbol table unchanged");
     free_interpreter();
 }
 
@@ -1517,6 +1550,563 @@ static void test_greater_than()
     test_eval_helper("(two-arg-greater-than 2 -3)", "t");
 }
 
+static void test_compile_bytecode()
+{
+    test_name = "compile_bytecode";
+    init_interpreter(65536);
+    lisp_object_t fn = compile_bytecode(parse1_wrapper("(cons 1 2)"));
+    check(functionp(fn) != NIL, "function");
+    check(LispFunctionPtr(fn)->kind == sym("compiled-function"), "kind");
+    char *str = print_object(apply(fn, NIL, NIL));
+    check(strcmp("(1 . 2)", str) == 0, "apply");
+    free(str);
+    free_interpreter();
+    test_eval_helper("(let ((x 0) (y nil)) (tagbody top (set 'y (cons x y)) (set 'x (two-arg-plus x 1)) (if (eq x 3) nil (go top))) y)", "(2 1 0)");
+    test_eval_helper("(condition-case e (raise 'oops 12) (oops (cons 'caught e)))", "(caught oops . 12)");
+    test_eval_helper("(let ((x 1) (y '(2 3))) `(a ,x ,@y b))", "(a 1 2 3 b)");
+    test_eval_helper("(funcall #'(lambda (x) (block nil (return-from nil (cons x x)))) 7)", "(7 . 7)");
+}
+
+static void test_lexical_scope()
+{
+    test_name = "lexical_scope";
+    test_eval_helper("(funcall (funcall #'(lambda (n) #'(lambda (x) (cons x n))) 3) 4)", "(4 . 3)");
+    test_eval_helper("(let ((x 1)) (let ((y 2)) (set 'x (cons x y)) x))", "(1 . 2)");
+    test_eval_helper("(let ((f #'(lambda () x))) (let ((x 1)) (condition-case e (funcall f) (unbound-variable 'free))))", "free");
+    test_eval_helper("(funcall #'(lambda (a &optional b &rest c) (cons a (cons b c))) 1 2 3 4)", "(1 2 3 4)");
+}
+
+static void test_parse_lambda_list()
+{
+    test_name = "parse_lambda_list";
+    init_interpreter(65536);
+    lisp_object_t parsed = parse_lambda_list(parse1_wrapper("(a b &optional c &rest d)"));
+    lisp_object_t counts = car(parsed);
+    check(LAMBDA_LIST_REQUIRED(counts) == 2, "required");
+    check(LAMBDA_LIST_OPTIONAL(counts) == 1, "optional");
+    check(LAMBDA_LIST_REST(counts) == 1, "rest");
+    char *str = print_object(cdr(parsed));
+    check(strcmp("(a b c d)", str) == 0, "variables");
+    free(str);
+    /* The tree-walker binds arguments in a frame too */
+    lisp_object_t result = eval(parse1_wrapper("(funcall (function (lambda (a &optional b &body c) (set (quote a) (cons a (cons b c))) a)) 1 2 3)"), NIL);
+    str = print_object(result);
+    check(strcmp("(1 2 3)", str) == 0, "eval");
+    free(str);
+    free_interpreter();
+}
+
+static void test_tail_calls()
+{
+    test_name = "tail_calls";
+    /* Deeper than the VM stack allows for nested calls */
+    test_eval_helper("(progn (set-symbol-function 'count-down #'(lambda (n) (if (= n 0) 'done (count-down (two-arg-minus n 1))))) (count-down 100000))", "done");
+    test_eval_helper("(progn (set-symbol-function 'count-down #'(lambda (n) (block count-down (if (= n 0) (return-from count-down 'done)) (let ((m (two-arg-minus n 1))) (count-down m))))) (count-down 100000))", "done");
+    test_eval_helper("(progn (set-symbol-function 'count-down #'(lambda (n) (condition-case e (if (= n 0) 'done (raise 'again n)) (again (count-down (two-arg-minus (cdr e) 1)))))) (count-down 100000))", "done");
+    test_eval_helper("(let ((f #'(lambda (k) (funcall k)))) (block b (funcall f #'(lambda () (return-from b 'escaped))) 'not-escaped))", "escaped");
+    /* The tree-walker's frames stay reachable through the dynamic
+       environment, so only the C stack is constant */
+    init_interpreter(64 * 1024 * 1024);
+    lisp_object_t result = eval(parse1_wrapper("(progn (set-symbol-function (quote count-down) (function (lambda (n) (if (= n 0) (quote done) (let ((m (two-arg-minus n 1))) (count-down m)))))) (count-down 100000))"), NIL);
+    char *str = print_object(result);
+    check(strcmp("done", str) == 0, "eval");
+    free(str);
+    free_interpreter();
+}
+
+static void test_call_cache()
+{
+    test_name = "call_cache";
+    test_eval_helper("(progn (set-symbol-function 'f #'(lambda () 1)) (let ((a (f))) (set-symbol-function 'f #'car) (cons a (f '(2)))))", "(1 . 2)");
+    test_eval_helper("(condition-case e (progn (set-symbol-function 'f #'(lambda (x) x)) (f 1 2)) (bad-args 'ok))", "ok");
+}
+
+static lisp_object_t five_args(lisp_object_t a, lisp_object_t b, lisp_object_t c, lisp_object_t d, lisp_object_t e)
+{
+    return List(e, d, c, b, a);
+}
+
+static lisp_object_t count_args(int nargs, lisp_object_t *args, lisp_object_t a)
+{
+    return (lisp_object_t)nargs << 4;
+}
+
+static void test_native_functions()
+{
+    test_name = "native_functions";
+    init_interpreter(65536 * 4);
+    define_native_function("five-args", (void (*)())five_args, 5, 0);
+    define_native_function("count-args", (void (*)())count_args, 1, NATIVE_VARIADIC);
+    char *str = print_object(eval_toplevel(parse1_wrapper("(five-args 1 2 3 4 5)")));
+    check(strcmp("(5 4 3 2 1)", str) == 0, "five args");
+    free(str);
+    str = print_object(eval_toplevel(parse1_wrapper("(cons (count-args 1 2 3 4 5 6 7 8) (funcall #'count-args 1 2))")));
+    check(strcmp("(8 . 2)", str) == 0, "variadic");
+    free(str);
+    str = print_object(eval_toplevel(parse1_wrapper("(condition-case e (count-args) (bad-args 'ok))")));
+    check(strcmp("ok", str) == 0, "too few");
+    free(str);
+    str = print_object(eval_toplevel(parse1_wrapper("(list 1 (list) (list 2 3))")));
+    check(strcmp("(1 nil (2 3))", str) == 0, "list");
+    free(str);
+    free_interpreter();
+}
+
+static void test_special_form_index()
+{
+    test_name = "special_form_index";
+    init_interpreter(65536);
+    check(SymbolSpecialForm(sym("if")) == SPECIAL_FORM_IF, "if");
+    check(SymbolSpecialForm(sym("condition-case")) == SPECIAL_FORM_CONDITION_CASE, "condition-case");
+    check(SymbolSpecialForm(sym("car")) == SPECIAL_FORM_NONE, "car");
+    check(SymbolSpecialForm(sym("not-a-special-form")) == SPECIAL_FORM_NONE, "new symbol");
+    free_interpreter();
+}
+
+static void test_special_variables()
+{
+    test_name = "special_variables";
+    test_eval_helper("(progn (proclaim-special 'x) (set-symbol-value 'x 3) (set 'x (two-arg-plus x 1)) (cons x (symbol-value 'x)))", "(4 . 4)");
+    test_eval_helper("(condition-case e x (unbound-variable (cons 'unbound e)))", "(unbound unbound-variable . x)");
+    init_interpreter(65536);
+    proclaim_special(sym("x"));
+    SymbolPtr(sym("x"))->value = 14 << 4;
+    /* The tree-walker sees a special variable unless it is bound */
+    check(eval(sym("x"), NIL) == 14 << 4, "eval");
+    check(eval(parse1_wrapper("(let ((x 1)) x)"), NIL) == 1 << 4, "shadowed");
+    free_interpreter();
+}
+
+static void test_local_block()
+{
+    test_name = "local_block";
+    test_eval_helper("(funcall #'(lambda (x) (block b (let ((y (cons x x))) (cons 1 (return-from b y))))) 7)", "(7 . 7)");
+    test_eval_helper("(funcall #'(lambda () (block b (tagbody (return-from b 'out)))))", "out");
+    test_eval_helper("(funcall #'(lambda () (block b (cons 1 (condition-case e (cons 2 (return-from b 'out)) (error 'caught))))))", "out");
+    test_eval_helper("(funcall #'(lambda () (cons (block a (block b (return-from a 1))) (block c 2))))", "(1 . 2)");
+    init_interpreter(65536 * 4);
+    /* Returning through a condition-case pops its context, and nothing
+       is left on the stack of contexts afterwards */
+    lisp_object_t result = test_eval_string_helper("(funcall #'(lambda (n) (let ((i 0)) (tagbody top (if (= i n) (go done)) (block b (condition-case e (let ((j i)) (return-from b j)) (error nil))) (set 'i (two-arg-plus i 1)) (go top) done) i)) 100000)");
+    check(result == 100000 << 4, "loop");
+    check(interp->return_stack == NULL, "contexts");
+    free_interpreter();
+}
+
+static void test_local_go()
+{
+    test_name = "local_go";
+    test_eval_helper("(funcall #'(lambda () (let ((x nil)) (tagbody (go b) a (set 'x (cons 'a x)) (go c) b (set 'x (cons 'b x)) (go a) c) x)))", "(a b)");
+    test_eval_helper("(funcall #'(lambda () (let ((x 0)) (tagbody top (let ((y (two-arg-plus x 1))) (set 'x y) (if (two-arg-less-than x 5) (cons 1 (go top))))) x)))", "5");
+    test_eval_helper("(funcall #'(lambda () (tagbody (condition-case e (go out) (error nil)) out)))", "nil");
+    test_eval_helper("(funcall #'(lambda () (let ((x nil)) (tagbody (go a) b (set 'x (cons 'outer x)) (go end) a (tagbody (go b) b (set 'x (cons 'inner x))) (go b) end) x)))", "(outer inner)");
+    /* A closure that goes to the tagbody needs a context */
+    test_eval_helper("(funcall #'(lambda () (let ((x 0)) (tagbody top (set 'x (two-arg-plus x 1)) (if (two-arg-less-than x 3) (funcall #'(lambda () (go top))))) x)))", "3");
+    init_interpreter(65536 * 4);
+    lisp_object_t result = test_eval_string_helper("(funcall #'(lambda (n) (let ((i 0)) (tagbody top (condition-case e (let ((j (two-arg-plus i 1))) (set 'i j) (if (two-arg-less-than i n) (go top))) (error nil))) i)) 100000)");
+    check(result == 100000 << 4, "loop");
+    check(interp->return_stack == NULL, "contexts");
+    /* The tree-walker evaluates a lowered tagbody */
+    char *str = print_object(compile_toplevel(parse1_wrapper("(tagbody a (foo) b (bar))")));
+    check(strcmp("(%tagbody #((foo) (bar)) ((b . 1) (a . 0)))", str) == 0, "lowered");
+    free(str);
+    result = eval(compile_toplevel(parse1_wrapper("(let ((x 0)) (tagbody top (set (quote x) (two-arg-plus x 1)) (if (two-arg-less-than x 3) (go top))) x)")), NIL);
+    check(result == 3 << 4, "eval");
+    free_interpreter();
+}
+
+static void test_return_contexts()
+{
+    test_name = "return_contexts";
+    init_interpreter(65536 * 4);
+    /* Each raise leaves through two handler contexts, and the values the
+       tree-walker holds across the setjmp survive collections */
+    lisp_object_t result = eval(compile_toplevel(parse1_wrapper("(let ((x nil) (n 0)) (tagbody top (set (quote x) (cons (condition-case e (condition-case f (raise (quote oops) n) (other nil)) (oops (cdr e))) (if x (cons (car x) nil)))) (set (quote n) (two-arg-plus n 1)) (if (two-arg-less-than n 20000) (go top))) (cons (car x) (car (cdr x))))")), NIL);
+    char *str = print_object(result);
+    check(strcmp("(19999 . 19998)", str) == 0, "eval");
+    free(str);
+    check(interp->return_stack == NULL, "popped");
+    free_interpreter();
+}
+
+static lisp_object_t context_depth()
+{
+    return interp->return_stack ? (interp->return_stack - interp->return_contexts + 1) << 4 : 0;
+}
+
+static void test_condition_case_context()
+{
+    test_name = "condition_case_context";
+    test_eval_helper("(condition-case e (raise 'b 1) (a 'a) (b (cons 'first e)) (b 'second))", "(first b . 1)");
+    test_eval_helper("(condition-case e (condition-case f (raise 'condition-case 1) (a 'a)) (condition-case 'ok))", "ok");
+    init_interpreter(65536 * 4);
+    define_native_function("context-depth", (void (*)())context_depth, 0, 0);
+    /* One context for three clauses, in compiled code and in the tree-walker */
+    lisp_object_t result = test_eval_string_helper("(condition-case e (context-depth) (a 1) (b 2) (c 3))");
+    check(result == 1 << 4, "vm");
+    result = eval(parse1_wrapper("(condition-case e (context-depth) (a 1) (b 2) (c 3))"), NIL);
+    check(result == 1 << 4, "eval");
+    check(interp->return_stack == NULL, "popped");
+    free_interpreter();
+}
+
+static void test_shadow_stack_overflow()
+{
+    test_name = "shadow_stack_overflow";
+    init_interpreter(65536 * 4);
+    define_defmacro();
+    test_eval_string_helper("(defmacro defun (fname arglist &body body) `(set-symbol-function ',fname #'(lambda ,arglist (block ,fname ,@body))))");
+    test_eval_string_helper("(defun deep (n) (if (eq n 0) 0 (two-arg-plus 1 (deep (two-arg-minus n 1)))))");
+    /* Most of the shadow stack is taken first, so that it runs out well
+       before the C stack does */
+    static lisp_object_t filler = NIL;
+    size_t shadow_sp = interp->shadow_sp;
+    while (interp->shadow_sp < SHADOW_STACK_SIZE - SHADOW_STACK_RESERVE - 4096)
+        interp->shadow_stack[interp->shadow_sp++] = &filler;
+    lisp_object_t result = test_eval_string_helper("(condition-case e (deep 100000) (stack-overflow 'caught))");
+    check(result == sym("caught"), "caught");
+    check(interp->shadow_sp < SHADOW_STACK_SIZE - SHADOW_STACK_RESERVE, "unwound");
+    interp->shadow_sp = shadow_sp;
+    free_interpreter();
+}
+
+static void test_quasiquote_expansion()
+{
+    test_name = "quasiquote_expansion";
+    test_eval_helper("(let ((x '(1 2))) `(,@x ,@x 3))", "(1 2 1 2 3)");
+    test_eval_helper("`(a `(b ,(c ,(two-arg-plus 1 2))))", "(a `(b ,(c 3)))");
+    test_eval_helper("(let ((x 1)) `(a . ,x))", "(a . 1)");
+    /* Constant parts of the template are shared between evaluations */
+    test_eval_helper("(let ((f #'(lambda (x) `(,x (a b))))) (eq (car (cdr (funcall f 1))) (car (cdr (funcall f 2)))))", "t");
+    init_interpreter(65536);
+    char *str = print_object(compile_toplevel(parse1_wrapper("`(a ,b c ,@d)")));
+    check(strcmp("(cons 'a (cons b (cons 'c d)))", str) == 0, "cons");
+    free(str);
+    str = print_object(compile_toplevel(parse1_wrapper("`(,a (b c) ,@d ,e)")));
+    check(strcmp("(cons a (cons '(b c) (append d (list e))))", str) == 0, "append");
+    free(str);
+    str = print_object(eval(parse1_wrapper("(let ((x (quote (1 2)))) `(,@x ,@x))"), NIL));
+    check(strcmp("(1 2 1 2)", str) == 0, "eval");
+    free(str);
+    free_interpreter();
+}
+
+static void test_expansion_sharing()
+{
+    test_name = "expansion_sharing";
+    init_interpreter(65536 * 4);
+    define_defmacro();
+    test_eval_string_helper("(defmacro ret (x) `(return-from b ,x))");
+    /* Code without macros comes back unchanged */
+    lisp_object_t expr = parse1_wrapper("(let ((x (f 1))) (if x (g x) (progn (h) 'y)) (condition-case e (i) (error (j e))) #'(lambda (y) (k y)))");
+    check(macroexpand_all(expr) == expr, "macroexpand_all");
+    check(compile_toplevel(expr) == expr, "compile");
+    /* Only the path to the macro call is copied */
+    expr = parse1_wrapper("(let ((x (f 1))) (ret x) (g x))");
+    lisp_object_t result = macroexpand_all(expr);
+    check(result != expr && cadr(result) == cadr(expr) && cadr(cddr(result)) == cadr(cddr(expr)), "copied path");
+    /* The compile pass expands macros itself, and only makes a block
+       that is returned from */
+    char *str = print_object(compile_toplevel(parse1_wrapper("(block b (ret 1))")));
+    check(strcmp("(%block 0 (raise 0 (progn (raise 0 1))))", str) == 0, "compile block");
+    free(str);
+    str = print_object(compile_toplevel(parse1_wrapper("(block b 1)")));
+    check(strcmp("(progn 1)", str) == 0, "compile progn");
+    free(str);
+    free_interpreter();
+}
+
+static void test_macro_cache()
+{
+    test_name = "macro_cache";
+    init_interpreter(65536 * 4);
+    define_defmacro();
+    test_eval_string_helper("(progn (set-symbol-value 'calls 0) (defmacro counted (x) (set-symbol-value 'calls (two-arg-plus (symbol-value 'calls) 1)) `(car ,x)))");
+    lisp_object_t expr = parse1_wrapper("(counted '(1 2))");
+    GC_PROTECT(expr);
+    lisp_object_t first = macroexpand(expr, NIL);
+    GC_PROTECT(first);
+    gc();
+    expr = parse1_wrapper("(counted '(1 2))");
+    check(macroexpand(expr, NIL) != first, "different cons");
+    lisp_object_t again = macroexpand(expr, NIL);
+    GC_PROTECT(again);
+    gc();
+    check(macroexpand(expr, NIL) == again, "same cons");
+    check(eval_toplevel(expr) == 1 << 4, "eval");
+    check(SymbolPtr(sym("calls"))->value == 2 << 4, "calls");
+    test_eval_string_helper("(defmacro counted (x) `(cdr ,x))");
+    check(macroexpand(expr, NIL) != again, "redefined");
+    free_interpreter();
+}
+
+static void test_optimize_helper(char *expr, char *expected)
+{
+    char *str = print_object(compile_toplevel(parse1_wrapper(expr)));
+    check(strcmp(expected, str) == 0, expr);
+    free(str);
+}
+
+static void test_optimize()
+{
+    test_name = "optimize";
+    init_interpreter(65536 * 4);
+    define_defmacro();
+    test_optimize_helper("(two-arg-plus 1 (two-arg-times 2 3))", "7");
+    test_optimize_helper("(car '(a b))", "'a");
+    test_optimize_helper("(two-arg-plus x (two-arg-minus 5 2))", "(two-arg-plus x 3)");
+    /* Errors are left for run time */
+    test_optimize_helper("(car 1)", "(car 1)");
+    test_optimize_helper("(if x (length \"abc\") 0)", "(if x (length \"abc\") 0)");
+    /* Only pure built-ins are folded */
+    test_optimize_helper("(cons 1 2)", "(cons 1 2)");
+    test_optimize_helper("(if (eq 'a 'a) (f) (g))", "(f)");
+    test_optimize_helper("(if (integerp 'a) (f))", "nil");
+    test_optimize_helper("(if x (progn 1 (f)) 2)", "(if x (f) 2)");
+    test_optimize_helper("(progn 1 (progn (f) 'a (g)) x)", "(progn (f) (g) x)");
+    test_optimize_helper("#'(lambda (x) 1 (progn x))", "(function (lambda (x) x))");
+    test_optimize_helper("(tagbody a 1 (progn (f)) (go a))", "(%tagbody #((f) (go a)) ((a . 0)))");
+    proclaim_constant(sym("limit"), 10 << 4);
+    test_optimize_helper("(two-arg-times limit limit)", "100");
+    check(test_eval_string_helper("(let ((y 2)) (two-arg-plus limit y))") == 12 << 4, "eval constant");
+    free_interpreter();
+}
+
+static void test_inline()
+{
+    test_name = "inline";
+    init_interpreter(65536 * 4);
+    define_defmacro();
+    test_eval_string_helper("(defmacro defun (fname arglist &body body) `(set-symbol-function ',fname #'(lambda ,arglist (block ,fname ,@body))))");
+    test_eval_string_helper("(defun helper (x) (cons x 1))");
+    char *str = print_object(getprop(sym("helper"), sym("inline-expansion")));
+    check(strcmp("(lambda (x) (cons x 1))", str) == 0, "expansion");
+    free(str);
+    /* Calls in definitions are inlined, with variable arguments
+       substituted and others bound by a let */
+    str = print_object(compile_toplevel(parse1_wrapper("(defun caller (y) (two-arg-plus (car (helper y)) (car (helper (car y)))))")));
+    check(strstr(str, "(lambda (y) (progn (two-arg-plus (car (cons y 1)) (car (let ((x (car y))) (cons x 1))))))") != NULL, "inlined");
+    free(str);
+    /* Not elsewhere */
+    str = print_object(compile_toplevel(parse1_wrapper("(helper 2)")));
+    check(strcmp("(helper 2)", str) == 0, "toplevel");
+    free(str);
+    /* Nor when recursive */
+    test_eval_string_helper("(defun recursive (n) (if n (recursive nil) 1))");
+    check(getprop(sym("recursive"), sym("inline-expansion")) == NIL, "recursive");
+    /* Redefinition recompiles the callers */
+    test_eval_string_helper("(defun caller (y) (helper y))");
+    check(getprop(sym("helper"), sym("inline-callers")) != NIL, "callers");
+    test_eval_string_helper("(defun helper (x) (cons 1 x))");
+    str = print_object(test_eval_string_helper("(caller 2)"));
+    check(strcmp("(1 . 2)", str) == 0, "recompiled");
+    free(str);
+    test_eval_string_helper("(let ((f #'(lambda (x) x))) (set-symbol-function 'helper f))");
+    check(getprop(sym("helper"), sym("inline-expansion")) == NIL, "expansion removed");
+    check(test_eval_string_helper("(caller 2)") == 2 << 4, "set-symbol-function");
+    /* As do redefinitions of the functions that calls are rewritten to
+       or compiled to an instruction for */
+    test_eval_string_helper("(defun + (a b) (two-arg-plus a b))");
+    test_eval_string_helper("(putprop '+ 'two-arg-function 'two-arg-plus)");
+    test_eval_string_helper("(defun add3 (x) (+ x 3))");
+    test_eval_string_helper("(defun add4 (x) (two-arg-plus x 4))");
+    check(test_eval_string_helper("(add3 1)") == 4 << 4, "two-arg-function");
+    test_eval_string_helper("(defun + (a b) 99)");
+    check(test_eval_string_helper("(add3 1)") == 99 << 4, "two-arg-function redefined");
+    check(test_eval_string_helper("(add4 1)") == 5 << 4, "primitive");
+    test_eval_string_helper("(set-symbol-function 'two-arg-plus #'(lambda (a b) 98))");
+    check(test_eval_string_helper("(add4 1)") == 98 << 4, "primitive redefined");
+    free_interpreter();
+}
+
+static void test_inline_argument_order()
+{
+    test_name = "inline_argument_order";
+    init_interpreter(65536 * 4);
+    define_defmacro();
+    test_eval_string_helper("(defmacro defun (fname arglist &body body) `(set-symbol-function ',fname #'(lambda ,arglist (block ,fname ,@body))))");
+    /* An argument that the body of an inlined function could change
+       is read before the body runs */
+    test_eval_string_helper("(proclaim-special '*g*)");
+    test_eval_string_helper("(set-symbol-value '*g* 1)");
+    test_eval_string_helper("(defun bump () (set '*g* 99))");
+    test_eval_string_helper("(defun inl (a) (bump) a)");
+    test_eval_string_helper("(defun caller-a () (inl *g*))");
+    check(test_eval_string_helper("(caller-a)") == 1 << 4, "special");
+    test_eval_string_helper("(defun inl2 (f v) (funcall f) v)");
+    test_eval_string_helper("(defun caller-b (x) (let ((f #'(lambda () (set 'x 5)))) (inl2 f x)))");
+    check(test_eval_string_helper("(caller-b 1)") == 1 << 4, "assigned by a closure");
+    /* Parameters that nothing assigns are substituted */
+    char *str = print_object(compile_toplevel(parse1_wrapper("(defun caller-c (x) (inl x))")));
+    check(strstr(str, "(progn (bump) x)") != NULL && strstr(str, "let") == NULL, "substituted");
+    free(str);
+    free_interpreter();
+}
+
+static void test_fixnum_declarations()
+{
+    test_name = "fixnum_declarations";
+    test_eval_helper("(let ((x 1)) (declare (fixnum x)) (two-arg-plus x 2))", "3");
+    test_eval_helper("(let ((x 1)) (declare (fixnum x)) (condition-case e (set 'x 'a) (type-error 'caught)))", "caught");
+    test_eval_helper("(funcall #'(lambda (x) (declare (fixnum x)) (two-arg-times x x)) 5)", "25");
+    test_eval_helper("(condition-case e (funcall #'(lambda (x) (declare (fixnum x)) x) 'a) (type-error 'caught))", "caught");
+    /* Inferred from the initial value and the sets */
+    test_eval_helper("(let ((i 0) (s 0)) (tagbody again (set 's (two-arg-plus s i)) (set 'i (two-arg-plus i 1)) (if (two-arg-less-than i 5) (go again))) s)", "10");
+    test_eval_helper("(let ((x 1)) (set 'x 'a) x)", "a");
+    /* Errors are raised rather than aborting */
+    test_eval_helper("(condition-case e (two-arg-plus 1 'a) (type-error 'caught))", "caught");
+    test_eval_helper("(let ((x 576460752303423487)) (condition-case e (two-arg-plus x 1) (integer-overflow 'overflow)))", "overflow");
+    test_eval_helper("(let ((x -576460752303423488)) (condition-case e (two-arg-times x 2) (integer-overflow 'overflow)))", "overflow");
+    /* The evaluator ignores declarations */
+    init_interpreter(65536 * 4);
+    char *str = print_object(eval(compile_toplevel(parse1_wrapper("(let ((x 1)) (declare (fixnum x)) x)")), NIL));
+    check(strcmp("1", str) == 0, "evaluator");
+    free(str);
+    free_interpreter();
+}
+
+static void test_generational_gc()
+{
+    test_name = "generational_gc";
+    init_interpreter(1024 * 1024);
+    struct lisp_heap *heap = &interp->heap;
+    lisp_object_t old_cons = cons(NIL, NIL);
+    GC_PROTECT(old_cons);
+    lisp_object_t old_vector = allocate_vector(2 << 4);
+    GC_PROTECT(old_vector);
+    gc();
+    lisp_object_t promoted_cons = old_cons;
+    check((char *)(old_cons & PTR_MASK) < heap->old_freeptr, "in from-space");
+    lisp_object_t young = cons(sym("young"), NIL);
+    rplacd(old_cons, young);
+    young = cons(sym("also-young"), NIL);
+    svref_set(old_vector, 1 << 4, young);
+    /* Fill the nursery, so that it is collected */
+    char *old_freeptr = heap->old_freeptr;
+    for (size_t i = 0; i <= heap->nursery_bytes / sizeof(struct cons); i++)
+        cons(NIL, NIL);
+    check(heap->old_freeptr > old_freeptr, "survivors promoted");
+    check(old_cons == promoted_cons, "old objects stay put");
+    char *str = print_object(old_cons);
+    check(strcmp("(nil young)", str) == 0, "rplacd");
+    free(str);
+    str = print_object(old_vector);
+    check(strcmp("#(nil (also-young))", str) == 0, "svref_set");
+    free(str);
+    free_interpreter();
+}
+
+static void test_incremental_gc()
+{
+    test_name = "incremental_gc";
+    init_interpreter(1024 * 1024);
+    set_gc_pause(1);
+    struct lisp_heap *heap = &interp->heap;
+    lisp_object_t old_vector = allocate_vector(2 << 4);
+    GC_PROTECT(old_vector);
+    lisp_object_t value = sym("before");
+    svref_set(old_vector, 0, value);
+    lisp_object_t name = sym("*old-vector*");
+    set_symbol_value(name, old_vector);
+    gc();
+    /* Promote garbage until a collection starts and its scan catches
+       up, so that the vector has a replica in to-space */
+    lisp_object_t keep = NIL;
+    GC_PROTECT(keep);
+    for (int i = 0; !heap->cycle_active || heap->to_freeptr == heap->to_space || heap->scanptr != heap->to_freeptr; i++)
+        keep = i % 1000 == 0 ? NIL : cons(NIL, keep);
+    value = sym("after");
+    svref_set(old_vector, 0, value);
+    value = cons(sym("young"), NIL);
+    svref_set(old_vector, 1 << 4, value);
+    gc();
+    check(!heap->cycle_active, "cycle finished");
+    char *str = print_object(old_vector);
+    check(strcmp("#(after (young))", str) == 0, "stores during the cycle survive");
+    free(str);
+    free_interpreter();
+}
+
+/* Replaces the lists in a vector, which stays live, over and over: a
+ * full collection of it all at once would take well over the budget */
+static void test_gc_pause_budget()
+{
+    test_name = "gc_pause_budget";
+    init_interpreter(4 * 1024 * 1024);
+    long budget = 100;
+    set_gc_pause(budget);
+    struct lisp_heap *heap = &interp->heap;
+    size_t len = 40000;
+    lisp_object_t vector = allocate_vector(len << 4);
+    GC_PROTECT(vector);
+    for (int round = 0; round < 3; round++) {
+        for (size_t i = 0; i < len; i++) {
+            lisp_object_t elt = List(i << 4, round << 4, i << 4, round << 4);
+            svref_set(vector, i << 4, elt);
+        }
+    }
+    check(heap->stats.full_collections > 0, "collections finished");
+    /* How long the pauses were depends on the machine and on what else
+       it is doing, so only the work is checked: each collection was
+       spread over many slices, none of which went far through the
+       lists */
+    check(heap->stats.increments >= 10 * heap->stats.full_collections, "slices per collection");
+    check(heap->scanned_per_slice < len * 4 * sizeof(struct cons) / 10, "work per slice");
+    printf("%s - longest pause %ld us, budget %ld us\n", test_name, heap->stats.max_pause, budget);
+    check(svref(vector, 7 << 4) != NIL && car(svref(vector, 7 << 4)) == 7 << 4, "contents");
+    free_interpreter();
+}
+
+static void test_heap_growth()
+{
+    test_name = "heap_growth";
+    init_interpreter(64 * 1024);
+    struct lisp_heap *heap = &interp->heap;
+    lisp_object_t list = NIL;
+    GC_PROTECT(list);
+    /* About 3MB of conses, which all stay live */
+    for (int i = 0; i < 100000; i++)
+        list = cons(i << 4, list);
+    check(heap->size_bytes > 64 * 1024, "grown");
+    check(car(list) == 99999 << 4, "contents");
+    size_t grown = heap->size_bytes;
+    list = NIL;
+    gc();
+    check(heap->size_bytes == 64 * 1024, "shrunk to the minimum");
+    set_heap_limits(256 * 1024, grown, 25);
+    gc();
+    check(heap->size_bytes == 256 * 1024, "new minimum");
+    free_interpreter();
+}
+
+static void test_gc_stats()
+{
+    test_name = "gc_stats";
+    init_interpreter(64 * 1024);
+    struct lisp_heap *heap = &interp->heap;
+    FILE *log = tmpfile();
+    set_gc_log(log);
+    lisp_object_t list = NIL;
+    GC_PROTECT(list);
+    for (int i = 0; i < 10000; i++)
+        list = cons(i << 4, list);
+    list = NIL;
+    gc();
+    check(heap->stats.minor_collections > 0, "minor collections");
+    check(heap->stats.full_collections > 0, "full collections");
+    check(heap->stats.max_pause <= heap->stats.total_pause, "pauses");
+    check(heap->stats.bytes_copied <= heap->stats.bytes_collected, "bytes copied");
+    check(heap->stats.occupancy_after < heap->stats.occupancy_before, "occupancy");
+    size_t full_collections = heap->stats.full_collections;
+    list = gc_statistics();
+    check(car(car(list)) == sym("full-collections"), "first field");
+    check(cdr(car(list)) == full_collections << 4, "full collections field");
+    set_gc_log(NULL);
+    check(ftell(log) > 0, "log written");
+    fclose(log);
+    free_interpreter();
+}
+
 int main(int argc, char **argv)
 {
     test_skip_whitespace();
@@ -1642,6 +2232,32 @@ int main(int argc, char **argv)
     test_if();
     test_less_than();
     test_greater_than();
+    test_compile_bytecode();
+    test_lexical_scope();
+    test_parse_lambda_list();
+    test_tail_calls();
+    test_call_cache();
+    test_native_functions();
+    test_special_form_index();
+    test_special_variables();
+    test_symbol_table_growth();
+    test_local_block();
+    test_local_go();
+    test_return_contexts();
+    test_condition_case_context();
+    test_shadow_stack_overflow();
+    test_quasiquote_expansion();
+    test_expansion_sharing();
+    test_macro_cache();
+    test_optimize();
+    test_inline();
+    test_inline_argument_order();
+    test_fixnum_declarations();
+    test_generational_gc();
+    test_incremental_gc();
+    test_gc_pause_budget();
+    test_heap_growth();
+    test_gc_stats();
     if (fail_count)
         printf("%d checks failed\n", fail_count);
     else
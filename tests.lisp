@@ -24,11 +24,63 @@
 	     (princ " test(s) failed\n")))
        (exit fail-count))))
 
+(defconstant test-constant 7)
+
+(defun inlined-helper (x) (cons x 1))
+
+(defun inlined-caller (y) (inlined-helper y))
+
 (defun test-function (a b)
   (cons 'hello (+ a b)))
 
+(defun dead-length (x)
+  (if x (length "abc") 0))
+
+(defmacro leave-with (value)
+  `(return-from leave ,value))
+
+(defun leave-early (x)
+  (block leave
+    (when x (leave-with 'early))
+    'late))
+
+(defmacro skip-to-end ()
+  '(go end))
+
+(defun skip-early (x)
+  (let ((result 'late))
+    (tagbody
+       (when x (skip-to-end))
+       (setq result 'early)
+     end)
+    result))
+
+(defparameter *tagbody-effects* nil)
+
+(defmacro ignore-form (form)
+  '*tagbody-effects*)
+
+(defun ignore-in-tagbody ()
+  (tagbody
+     (ignore-form (set '*tagbody-effects* 'evaluated)))
+  *tagbody-effects*)
+
 (do-tests
+  (do-test (let ((s 0)) (dotimes (i 10) (setq s (+ s i))) s) 45)
+  (do-test (condition-case e (+ 1 'a) (type-error 'caught)) 'caught)
+  (do-test (inlined-caller 2) '(2 . 1))
+  (do-test (progn (defun inlined-helper (x) (cons 1 x)) (inlined-caller 2)) '(1 . 2))
+  (do-test (+ test-constant 1) 8)
+  (do-test (dead-length nil) 0)
+  (do-test (leave-early t) 'early)
+  (do-test (leave-early nil) 'late)
+  (do-test (skip-early t) 'late)
+  (do-test (skip-early nil) 'early)
+  (do-test (ignore-in-tagbody) nil)
+  (do-test (condition-case e (dead-length t) (type-error 'caught)) 'caught)
+  (do-test (if (eq test-constant 7) (progn 1 'a) 'b) 'a)
   (do-test (type-of 14) 'integer)
+  (do-test (car (car (gc-stats))) 'full-collections)
   (do-test (type-of 'foo) 'symbol)
   (do-test (type-of (cons 'a nil)) 'cons)
   (do-test (type-of "foo") 'string)
@@ -0,0 +1,387 @@
+#include "vm.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The bytecode and constants of the running function are re-derived
+   from their Lisp objects at every instruction, as anything that
+   allocates can move them */
+#define BYTES(bytecode) ((unsigned char *)StringPtr(bytecode) + sizeof(struct string_header))
+
+#define READ_U8() (BYTES(bytecode)[pc++])
+#define READ_U16() (pc += 2, BYTES(bytecode)[pc - 2] | (BYTES(bytecode)[pc - 1] << 8))
+
+/* Values are computed before they are stored so that nothing that
+   allocates runs while the stack is in an inconsistent state */
+#define PUSH(x)                                  \
+    do {                                         \
+        lisp_object_t pushed_value = (x);        \
+        interp->vm_stack[interp->vm_sp++] = pushed_value; \
+    } while (0)
+#define POP() (interp->vm_stack[--interp->vm_sp])
+#define TOP() (interp->vm_stack[interp->vm_sp - 1])
+
+/* The operands of the integer instructions, which the checked forms
+   pass to the built-in function unless both are integers, as do all
+   forms when the result overflows.  The built-in then raises the
+   error. */
+#define FIXNUM_OPERANDS(x, y) ((((x) | (y)) & TYPE_MASK) == 0)
+#define INTEGER_OP(checked, overflowed, builtin)             \
+    do {                                                     \
+        lisp_object_t y = POP();                             \
+        lisp_object_t x = TOP();                             \
+        int64_t result;                                      \
+        if ((checked && !FIXNUM_OPERANDS(x, y)) || overflowed) \
+            result = builtin(x, y);                          \
+        TOP() = result;                                      \
+    } while (0)
+#define COMPARISON_OP(checked, test, builtin)                \
+    do {                                                     \
+        lisp_object_t y = POP();                             \
+        lisp_object_t x = TOP();                             \
+        if (checked && !FIXNUM_OPERANDS(x, y))               \
+            TOP() = builtin(x, y);                           \
+        else                                                 \
+            TOP() = (test) ? T : NIL;                        \
+    } while (0)
+
+lisp_object_t make_compiled_function(lisp_object_t code, lisp_object_t env)
+{
+    GC_PROTECT(code);
+    GC_PROTECT(env);
+    lisp_object_t fn = allocate_function();
+    struct lisp_function *fnptr = LispFunctionPtr(fn);
+    fnptr->kind = interp->syms.compiled_function;
+    fnptr->actual_function = code;
+    fnptr->environment = env;
+    fnptr->arguments = svref(code, CODE_LAMBDA_LIST << 4);
+    return fn;
+}
+
+/* The environment of the caller is not visible to a compiled function,
+   only the one it closed over */
+static lisp_object_t function_environment(lisp_object_t fn, lisp_object_t x)
+{
+    struct lisp_function *fnptr = LispFunctionPtr(fn);
+    lisp_object_t env = fnptr->environment;
+    if (cdr(fnptr->arguments) != NIL)
+        return make_frame(fnptr->arguments, x, env);
+    else if (x != NIL)
+        return raise_condition("bad-args", x);
+    return env;
+}
+
+lisp_object_t apply_compiled_function(lisp_object_t fn, lisp_object_t x, lisp_object_t a)
+{
+    GC_PROTECT(fn);
+    lisp_object_t env = function_environment(fn, x);
+    return vm_execute(LispFunctionPtr(fn)->actual_function, env);
+}
+
+static lisp_object_t pop_arguments(int nargs)
+{
+    lisp_object_t args = NIL;
+    for (int i = 1; i <= nargs; i++)
+        args = cons(interp->vm_stack[interp->vm_sp - i], args);
+    interp->vm_sp -= nargs;
+    return args;
+}
+
+/* Every constant of a code object has a pair of slots in its call
+   cache.  For a constant naming a called function these hold the
+   function epoch at which the name was last resolved, and what it
+   resolved to. */
+static lisp_object_t resolve_function(lisp_object_t constants, lisp_object_t call_cache, int index)
+{
+    lisp_object_t *entry = VectorStorage(call_cache) + 2 * index;
+    lisp_object_t epoch = interp->function_epoch << 4;
+    if (entry[0] == epoch)
+        return entry[1];
+    lisp_object_t symbol = VectorStorage(constants)[index];
+    lisp_object_t function = SymbolPtr(symbol)->function;
+    if (function == NIL)
+        return raise_condition("undefined-function", symbol);
+    entry[0] = epoch;
+    entry[1] = function;
+    write_barrier(&entry[0], epoch);
+    write_barrier(&entry[1], function);
+    return function;
+}
+
+/* Built-in functions are called with their arguments straight off the
+   stack; anything else gets them as a list.  The arguments stay on the
+   stack until the call returns. */
+static lisp_object_t call_function(lisp_object_t function, int nargs)
+{
+    if (functionp(function) != NIL && LispFunctionPtr(function)->kind == interp->syms.built_in_function)
+        return call_native_function(function, nargs, interp->vm_stack + interp->vm_sp - nargs, NIL);
+    GC_PROTECT(function);
+    lisp_object_t list = NIL;
+    for (int i = nargs - 1; i >= 0; i--)
+        list = cons(interp->vm_stack[interp->vm_sp - nargs + i], list);
+    return apply(function, list, NIL);
+}
+
+static lisp_object_t *frame_slot(lisp_object_t env, int depth, int slot)
+{
+    for (; depth > 0; depth--)
+        env = VectorStorage(env)[FRAME_PARENT];
+    return &VectorStorage(env)[slot];
+}
+
+lisp_object_t vm_execute(lisp_object_t code, lisp_object_t env)
+{
+    GC_PROTECT(code);
+    GC_PROTECT(env);
+    lisp_object_t bytecode = svref(code, CODE_BYTECODE << 4);
+    GC_PROTECT(bytecode);
+    lisp_object_t constants = svref(code, CODE_CONSTANTS << 4);
+    GC_PROTECT(constants);
+    lisp_object_t call_cache = svref(code, CODE_CALL_CACHE << 4);
+    GC_PROTECT(call_cache);
+    size_t base = interp->vm_sp;
+    size_t pc = 0;
+enter:
+    if (base + (svref(code, CODE_MAX_STACK << 4) >> 4) > VM_STACK_SIZE)
+        return raise(sym("stack-overflow"), NIL);
+    for (;;) {
+        switch (READ_U8()) {
+        case OP_CONST: {
+            int index = READ_U16();
+            PUSH(VectorStorage(constants)[index]);
+            break;
+        }
+        case OP_NIL:
+            PUSH(NIL);
+            break;
+        case OP_T:
+            PUSH(T);
+            break;
+        case OP_POP:
+            interp->vm_sp--;
+            break;
+        case OP_LOCALREF: {
+            int depth = READ_U8();
+            int slot = READ_U8();
+            PUSH(*frame_slot(env, depth, slot));
+            break;
+        }
+        case OP_LOCALSET: {
+            int depth = READ_U8();
+            int slot = READ_U8();
+            lisp_object_t *p = frame_slot(env, depth, slot);
+            *p = TOP();
+            write_barrier(p, TOP());
+            break;
+        }
+        case OP_GLOBALREF: {
+            lisp_object_t symbol = VectorStorage(constants)[READ_U16()];
+            if (!SymbolIsSpecial(symbol))
+                return raise_condition("unbound-variable", symbol);
+            PUSH(SymbolPtr(symbol)->value);
+            break;
+        }
+        case OP_GLOBALSET: {
+            lisp_object_t symbol = VectorStorage(constants)[READ_U16()];
+            if (SymbolIsSpecial(symbol))
+                set_symbol_value(symbol, TOP());
+            else
+                assign_variable(symbol, TOP(), NIL);
+            break;
+        }
+        case OP_SET: {
+            lisp_object_t value = assign_variable(interp->vm_stack[interp->vm_sp - 2], TOP(), NIL);
+            interp->vm_sp -= 2;
+            PUSH(value);
+            break;
+        }
+        case OP_JUMP:
+            pc = READ_U16();
+            break;
+        case OP_JUMP_IF_NIL: {
+            size_t target = READ_U16();
+            if (POP() == NIL)
+                pc = target;
+            break;
+        }
+        case OP_CALL: {
+            lisp_object_t function = resolve_function(constants, call_cache, READ_U16());
+            int nargs = READ_U8();
+            lisp_object_t result = call_function(function, nargs);
+            interp->vm_sp -= nargs;
+            PUSH(result);
+            break;
+        }
+        case OP_TAILCALL: {
+            lisp_object_t function = resolve_function(constants, call_cache, READ_U16());
+            int nargs = READ_U8();
+            if (functionp(function) == NIL || LispFunctionPtr(function)->kind != interp->syms.compiled_function) {
+                /* Carry on to the return that follows */
+                lisp_object_t result = call_function(function, nargs);
+                interp->vm_sp -= nargs;
+                PUSH(result);
+                break;
+            }
+            GC_PROTECT(function);
+            lisp_object_t args = pop_arguments(nargs);
+            env = function_environment(function, args);
+            code = LispFunctionPtr(function)->actual_function;
+            bytecode = svref(code, CODE_BYTECODE << 4);
+            constants = svref(code, CODE_CONSTANTS << 4);
+            call_cache = svref(code, CODE_CALL_CACHE << 4);
+            interp->vm_sp = base;
+            pc = 0;
+            goto enter;
+        }
+        case OP_FUNCTION: {
+            int index = READ_U16();
+            PUSH(eval_function(VectorStorage(constants)[index], env));
+            break;
+        }
+        case OP_CLOSURE: {
+            int index = READ_U16();
+            PUSH(make_compiled_function(VectorStorage(constants)[index], env));
+            break;
+        }
+        case OP_LET: {
+            int count = READ_U8();
+            lisp_object_t frame = allocate_vector((count + FRAME_FIRST_SLOT) << 4);
+            lisp_object_t *slots = VectorStorage(frame);
+            slots[FRAME_PARENT] = env;
+            slots[FRAME_VARIABLES] = NIL;
+            memcpy(slots + FRAME_FIRST_SLOT, interp->vm_stack + interp->vm_sp - count, count * sizeof(lisp_object_t));
+            interp->vm_sp -= count;
+            PUSH(env);
+            env = frame;
+            break;
+        }
+        case OP_UNLET: {
+            lisp_object_t result = POP();
+            env = TOP();
+            TOP() = result;
+            break;
+        }
+        case OP_BLOCK: {
+            lisp_object_t block_number = VectorStorage(constants)[READ_U16()];
+            size_t exit = READ_U16();
+            PUSH(env);
+            push_return_context(block_number);
+            interp->return_stack->vm_pc = exit;
+            if (__builtin_setjmp(interp->return_stack->buf)) {
+                /* raise() has restored the stack pointer */
+                pc = interp->return_stack->vm_pc;
+                lisp_object_t result = pop_return_context();
+                env = TOP();
+                TOP() = result;
+            }
+            break;
+        }
+        case OP_TAGBODY: {
+            lisp_object_t tags = VectorStorage(constants)[READ_U16()];
+            PUSH(env);
+            push_return_context(interp->syms.tagbody);
+            interp->return_stack->return_value = tags;
+            if (__builtin_setjmp(interp->return_stack->buf)) {
+                /* evalgo() has restored the stack pointer */
+                pc = interp->return_stack->vm_pc;
+                env = TOP();
+            }
+            break;
+        }
+        case OP_GO: {
+            int index = READ_U16();
+            evalgo(VectorStorage(constants)[index]);
+            break;
+        }
+        case OP_CONDITION_CASE: {
+            size_t operands = pc;
+            lisp_object_t clauses = VectorStorage(constants)[READ_U16()];
+            int count = READ_U8();
+            pc += 2 * count;
+            PUSH(env);
+            push_condition_case_context(clauses);
+            interp->return_stack->vm_pc = operands;
+            if (__builtin_setjmp(interp->return_stack->buf)) {
+                /* raise() has restored the stack pointer, popped the
+                   contexts above this one and made the condition */
+                pc = interp->return_stack->vm_pc;
+                lisp_object_t condition = pop_return_context();
+                clauses = VectorStorage(constants)[READ_U16()];
+                pc += 1 + 2 * (cdr(assoc(car(condition), clauses)) >> 4);
+                pc = READ_U16();
+                env = TOP();
+                TOP() = condition;
+            }
+            break;
+        }
+        case OP_UNWIND: {
+            int contexts = READ_U8();
+            int drop = READ_U16();
+            int frames = READ_U8();
+            lisp_object_t result = POP();
+            for (int i = 0; i < contexts; i++)
+                pop_return_context();
+            interp->vm_sp -= drop;
+            for (int i = 0; i < frames; i++)
+                env = VectorStorage(env)[FRAME_PARENT];
+            PUSH(result);
+            break;
+        }
+        case OP_POP_CONTEXTS: {
+            int count = READ_U8();
+            for (int i = 0; i < count; i++)
+                pop_return_context();
+            lisp_object_t result = POP();
+            TOP() = result;
+            break;
+        }
+        case OP_ADD:
+            INTEGER_OP(1, __builtin_add_overflow((int64_t)x, (int64_t)y, &result), plus);
+            break;
+        case OP_SUB:
+            INTEGER_OP(1, __builtin_sub_overflow((int64_t)x, (int64_t)y, &result), minus);
+            break;
+        case OP_MUL:
+            INTEGER_OP(1, __builtin_mul_overflow(((int64_t)x) >> 4, (int64_t)y, &result), times);
+            break;
+        case OP_LESS:
+            COMPARISON_OP(1, (int64_t)x < (int64_t)y, less_than);
+            break;
+        case OP_GREATER:
+            COMPARISON_OP(1, (int64_t)x > (int64_t)y, greater_than);
+            break;
+        case OP_FIXNUM_ADD:
+            INTEGER_OP(0, __builtin_add_overflow((int64_t)x, (int64_t)y, &result), plus);
+            break;
+        case OP_FIXNUM_SUB:
+            INTEGER_OP(0, __builtin_sub_overflow((int64_t)x, (int64_t)y, &result), minus);
+            break;
+        case OP_FIXNUM_MUL:
+            INTEGER_OP(0, __builtin_mul_overflow(((int64_t)x) >> 4, (int64_t)y, &result), times);
+            break;
+        case OP_FIXNUM_LESS:
+            COMPARISON_OP(0, (int64_t)x < (int64_t)y, less_than);
+            break;
+        case OP_FIXNUM_GREATER:
+            COMPARISON_OP(0, (int64_t)x > (int64_t)y, greater_than);
+            break;
+        case OP_EQ: {
+            lisp_object_t y = POP();
+            TOP() = TOP() == y ? T : NIL;
+            break;
+        }
+        case OP_CHECK_FIXNUM:
+            check_integer(TOP());
+            break;
+        case OP_RETURN: {
+            lisp_object_t result = POP();
+            interp->vm_sp = base;
+            return result;
+        }
+        default:
+            abort();
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef VM_H
+#define VM_H
+
+#include "lisp.h"
+
+/* Bytecode instruction set.  Each instruction is a single opcode byte
+   followed by its operands: u8 operands are one byte, u16 operands are
+   two bytes, little-endian.  Jump targets are absolute offsets into the
+   bytecode. */
+enum opcode {
+    OP_CONST, /* u16 constant */
+    OP_NIL,
+    OP_T,
+    OP_POP,
+    OP_LOCALREF, /* u8 frame depth, u8 slot */
+    OP_LOCALSET, /* u8 frame depth, u8 slot; value stays on the stack */
+    OP_GLOBALREF, /* u16 symbol constant */
+    OP_GLOBALSET, /* u16 symbol constant; value stays on the stack */
+    OP_SET, /* pops value, symbol */
+    OP_JUMP, /* u16 target */
+    OP_JUMP_IF_NIL, /* u16 target; pops test value */
+    OP_CALL, /* u16 symbol constant, u8 argument count */
+    OP_TAILCALL, /* as OP_CALL, but replaces the running function when it can */
+    OP_FUNCTION, /* u16 symbol constant */
+    OP_CLOSURE, /* u16 code constant */
+    OP_LET, /* u8 count; pops values into a new frame, pushes old environment */
+    OP_UNLET, /* restores environment saved by OP_LET */
+    OP_BLOCK, /* u16 block number constant, u16 exit target */
+    OP_TAGBODY, /* u16 tag alist constant */
+    OP_GO, /* u16 tag constant */
+    OP_CONDITION_CASE, /* u16 constant mapping clause symbols to indexes, u8 count, count * u16 handler targets */
+    OP_POP_CONTEXTS, /* u8 count */
+    OP_UNWIND, /* u8 contexts, u16 stack values, u8 frames; keeps the value on top */
+    OP_ADD, /* pops two integers, pushes their sum */
+    OP_SUB,
+    OP_MUL,
+    OP_LESS, /* pops two integers, pushes t if the first is less */
+    OP_GREATER,
+    OP_FIXNUM_ADD, /* as OP_ADD, for operands known to be integers */
+    OP_FIXNUM_SUB,
+    OP_FIXNUM_MUL,
+    OP_FIXNUM_LESS,
+    OP_FIXNUM_GREATER,
+    OP_EQ, /* pops two values, pushes t if they are the same object */
+    OP_CHECK_FIXNUM, /* raises a type-error unless the value on top is an integer */
+    OP_RETURN
+};
+
+/* A code object is a Lisp vector with these slots */
+#define CODE_BYTECODE 0 /* a string used as a byte buffer */
+#define CODE_CONSTANTS 1 /* a vector */
+#define CODE_LAMBDA_LIST 2 /* parsed */
+#define CODE_MAX_STACK 3 /* integer */
+#define CODE_CALL_CACHE 4 /* a vector, see resolve_function() in vm.c */
+#define CODE_SLOTS 5
+
+/* Values stack shared by all activations of the VM */
+#define VM_STACK_SIZE (64 * 1024)
+
+lisp_object_t compile_bytecode(lisp_object_t expr);
+lisp_object_t vm_execute(lisp_object_t code, lisp_object_t env);
+lisp_object_t apply_compiled_function(lisp_object_t fn, lisp_object_t x, lisp_object_t a);
+lisp_object_t make_compiled_function(lisp_object_t code, lisp_object_t env);
+
+#endif